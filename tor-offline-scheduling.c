@@ -3,11 +3,24 @@
 #include <string.h>
 #include <glib.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNEL
+#include <immintrin.h>
+#endif
+
 //#define debug(...) fprintf(stderr, ##__VA_ARGS__)
 #define g_debug(...)
 
 #define FOREACH(head, v) for(GQueue *iter = head, v = head->data; iter; iter = g_list_next(iter), v = iter->data)
 
+/* relay roles from the flags column of the relays file, the family id sits
+ * above the role bits and is 0 for relays in no family */
+#define RELAY_FLAG_GUARD 0x1
+#define RELAY_FLAG_EXIT 0x2
+#define RELAY_ROLES (RELAY_FLAG_GUARD | RELAY_FLAG_EXIT)
+#define RELAY_FAMILY_SHIFT 2
+#define RELAY_FAMILY(flags) ((flags) >> RELAY_FAMILY_SHIFT)
+
 typedef struct circuit_s {
     gchar *guard;
     gchar *middle;
@@ -16,31 +29,136 @@ typedef struct circuit_s {
     gchar *client;
     gdouble start_time;
     gdouble end_time;
+    gint id;
+    gint relays[3];
 } circuit_t;
 
+typedef struct circuit_catalog_s circuit_catalog_t;
+
+/* running totals of circuit weights, each circuit weighing its bandwidth in
+ * KiB (at least one), so a weighted draw is a binary search.  A sampler over
+ * the catalog has no totals and draws from the catalog instead */
+typedef struct circuit_sampler_s {
+    gint ncircuits;
+    gint64 *cumulative_weight;
+    circuit_catalog_t *catalog;
+} circuit_sampler_t;
+
+/* guard, middle and exit relay ids of a circuit list as separate columns */
+typedef struct circuit_columns_s {
+    gint ncircuits;
+    gint *relays[3];
+} circuit_columns_t;
+
+/* triples x < y < z of positions with x in first and y, z in rest, the sets
+ * being masks over role classes (RELAY_ROLES bits), and prefix tables giving
+ * how many of them lie lexicographically before a triple */
+typedef struct catalog_term_s {
+    gint sign;
+    guint first;
+    guint rest;
+    gint *count;
+    gint64 *pair_prefix;
+    gint64 *single_prefix;
+} catalog_term_t;
+
+#define CATALOG_MAX_TERMS 5
+#define CATALOG_MAX_DRAWS 1000000
+
+/* every circuit of the full network without materializing any: relay triples
+ * i < j < k of positions that can be placed as guard, middle and exit, in
+ * lexicographic order.  Valid triples are counted as all triples less the
+ * invalid kinds in terms, so a triple's index is a few lookups per term and an
+ * index maps back to its triple with three binary searches over positions.
+ * by_bandwidth, sorted and draw_weight serve draws weighted by bandwidth. */
+struct circuit_catalog_s {
+    gint nrelays;
+    gchar **relay_names;
+    gint *relay_bandwidth;
+    guint *relay_flags;
+    gint *relays;
+    gint ncircuits;
+    catalog_term_t terms[CATALOG_MAX_TERMS];
+    gint nterms;
+    gint *by_bandwidth;
+    gint *sorted[4];
+    gint *class_before[4];
+    gint64 *draw_weight;
+};
+
 typedef struct download_s {
     gchar *client;
     gint start_time;
     gint end_time;
     gdouble bandwidth;
-    gchar *bottleneck;
-    GQueue *circuits;
-    gint total_circuit_bandwidth;
+    gint ncircuits;
     circuit_t **circuit_list;
-    circuit_t **weighted_circuit_list;
+    circuit_sampler_t *circuit_sampler;
+    circuit_columns_t *circuit_columns;
+    gint id;
 } download_t;
 
+/* relays, circuits and downloads interned to dense integer ids, relays[] in
+ * circuit_t and all per relay/download arrays are indexed by these ids.  With
+ * a catalog circuits is NULL and circuit ids are catalog indexes */
+typedef struct network_s {
+    gint nrelays;
+    gchar **relay_names;
+    gint *relay_bandwidth;
+    GHashTable *relay_ids;
+    gint ncircuits;
+    circuit_t **circuits;
+    gint ndownloads;
+    download_t **downloads;
+    GQueue *circuit_columns;
+    circuit_catalog_t *catalog;
+} network_t;
+
+/* set of active download ids, position is indexed by download id and is -1
+ * for downloads not in the set */
+typedef struct active_set_s {
+    gint *downloads;
+    gint *position;
+    gint ndownloads;
+} active_set_t;
+
+/* with delta evaluation each experiment caches its per tick bandwidth, two
+ * banks so children can read their parents' cache while writing their own,
+ * and a child only re-solves ticks where one of its changed downloads is active.
+ * cache_misses holds the ticks it solved that were not in the solve cache */
 typedef struct experiment_t {
-    GHashTable *circuit_selection;
-    gint score;
+    gint *circuit_selection;
+    gdouble score;
+    gint *tick_bandwidth[2];
+    gint *reference_bandwidth;
+    gint *changed_downloads;
+    gint nchanged_downloads;
+    GArray *cache_misses;
 } experiment_t;
 
+typedef struct executor_s executor_t;
+typedef struct solve_cache_s solve_cache_t;
+
+/* chromosomes of a whole generation live in one slab, experiment i's circuit
+ * selection being row i, and children are bred into the other slab */
 typedef struct experiment_info_t {
     GQueue *downloads;
-    GHashTable *relays;
+    network_t *network;
+    experiment_t **experiments;
+    gint *selection_slab[2];
+    gint selection_bank;
     GHashTable *downloads_by_tick;
     GQueue *ticks;
     GTimer *round_timer;
+    gboolean delta_evaluation;
+    gint cache_bank;
+    gint nticks;
+    gint *download_start_ticks;
+    gint *download_end_ticks;
+    gint nticks_solved;
+    executor_t *executor;
+    gint nsegments;
+    solve_cache_t *solve_cache;
 } experiment_info_t;
 
 
@@ -77,6 +195,86 @@ static void log_handler_cb(const gchar *log_domain, GLogLevelFlags log_level, co
     }
 }
 
+/*
+ * Random number generation
+ *
+ * xoshiro256** seeded through splitmix64.  rng_jump advances a generator by
+ * 2^128 draws, so a master generator hands out non-overlapping streams by
+ * copying itself and jumping.
+ */
+
+typedef struct rng_s {
+    guint64 s[4];
+} rng_t;
+
+static inline guint64 rng_rotl(guint64 x, gint k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed(rng_t *rng, guint64 seed) {
+    for(gint i = 0; i < 4; i++) {
+        seed += 0x9e3779b97f4a7c15ULL;
+        guint64 z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+guint64 rng_next(rng_t *rng) {
+    guint64 *s = rng->s;
+    guint64 result = rng_rotl(s[1] * 5, 7) * 9;
+    guint64 t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+
+    return result;
+}
+
+void rng_jump(rng_t *rng) {
+    static const guint64 jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+
+    guint64 s[4] = { 0, 0, 0, 0 };
+    for(gint i = 0; i < 4; i++) {
+        for(gint b = 0; b < 64; b++) {
+            if(jump[i] & (1ULL << b)) {
+                for(gint j = 0; j < 4; j++) {
+                    s[j] ^= rng->s[j];
+                }
+            }
+            rng_next(rng);
+        }
+    }
+    memcpy(rng->s, s, sizeof(s));
+}
+
+/* uniform in [0, n) */
+gint64 rng_int(rng_t *rng, gint64 n) {
+    g_assert(n > 0);
+    return (gint64)(rng_next(rng) % (guint64)n);
+}
+
+/* uniform in [0, 1) */
+gdouble rng_double(rng_t *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* one stream per item, identical whichever thread ends up using it */
+rng_t *rng_streams_new(rng_t *master, gint n) {
+    rng_t *streams = g_new(rng_t, n);
+    for(gint i = 0; i < n; i++) {
+        streams[i] = *master;
+        rng_jump(master);
+    }
+    return streams;
+}
+
 /*
  * Helper functions
  */
@@ -115,51 +313,150 @@ static int compare_download_by_bandwidth(gconstpointer p1, gconstpointer p2, gpo
 
 void free_download(gpointer data) {
     download_t *download = (download_t *)data;
-    g_free(download->client);
     g_free(download);
 }
 
-gchar **get_file_lines(gchar *filename) {
-    gchar *content;
+/*
+ * Input parsing
+ *
+ * Input files are mapped and walked a line at a time, tokens pointing into the
+ * mapping.  Numbers are parsed from the tokens in place and names are interned
+ * into a string chunk owned by the caller, so a file costs no allocation per
+ * line beyond the records it describes.
+ */
+
+typedef struct input_file_s {
+    GMappedFile *mapped;
+    const gchar *position;
+    const gchar *end;
+    GString *scratch;
+} input_file_t;
+
+typedef struct token_s {
+    const gchar *start;
     gsize length;
+} token_t;
+
+#define INPUT_MAX_TOKENS 16
+
+static gboolean input_file_open(input_file_t *input, const gchar *filename) {
     GError *error = NULL;
 
-    /* read in download start and end times */
-    gboolean success = g_file_get_contents(filename, &content, &length, &error);
-    if(!success) {
-        g_error("[ERROR] g_file_get_contents: %s", error->message);
+    input->mapped = g_mapped_file_new(filename, FALSE, &error);
+    if(!input->mapped) {
+        g_error("[ERROR] g_mapped_file_new: %s", error->message);
         g_error_free(error);
-        return NULL;
+        return FALSE;
+    }
+
+    input->position = g_mapped_file_get_contents(input->mapped);
+    input->end = input->position ? input->position + g_mapped_file_get_length(input->mapped) : NULL;
+    input->scratch = g_string_sized_new(64);
+
+    return TRUE;
+}
+
+static void input_file_close(input_file_t *input) {
+    g_mapped_file_unref(input->mapped);
+    g_string_free(input->scratch, TRUE);
+}
+
+/* splits the next non-empty line into tokens separated by any of separators,
+ * returning how many tokens it has (at most INPUT_MAX_TOKENS are stored) or
+ * -1 at the end of the file.  line is set to the line for warnings */
+static gint input_file_next(input_file_t *input, const gchar *separators, token_t *tokens, token_t *line) {
+    while(input->position < input->end) {
+        const gchar *start = input->position;
+        const gchar *end = memchr(start, '\n', input->end - start);
+        if(!end) {
+            end = input->end;
+        }
+        input->position = end + 1;
+
+        line->start = start;
+        line->length = end - start;
+
+        gint ntokens = 0;
+        const gchar *cursor = start;
+        while(cursor < end) {
+            while(cursor < end && strchr(separators, *cursor)) {
+                cursor++;
+            }
+            const gchar *token_start = cursor;
+            while(cursor < end && !strchr(separators, *cursor)) {
+                cursor++;
+            }
+            if(cursor > token_start) {
+                if(ntokens < INPUT_MAX_TOKENS) {
+                    tokens[ntokens].start = token_start;
+                    tokens[ntokens].length = cursor - token_start;
+                }
+                ntokens++;
+            }
+        }
+
+        if(ntokens) {
+            return ntokens;
+        }
     }
 
-    gchar **lines = g_strsplit(content, "\n", 0);
-    g_free(content);
+    return -1;
+}
+
+/* NUL-terminated copy of a token in the file's scratch buffer, valid until
+ * the next call */
+static const gchar *input_file_string(input_file_t *input, token_t *token) {
+    g_string_truncate(input->scratch, 0);
+    g_string_append_len(input->scratch, token->start, token->length);
+    return input->scratch->str;
+}
+
+static gchar *input_file_intern(input_file_t *input, GStringChunk *names, token_t *token) {
+    return g_string_chunk_insert_const(names, input_file_string(input, token));
+}
+
+static gdouble token_to_double(token_t *token) {
+    gchar buffer[64];
+    gsize length = MIN(token->length, sizeof(buffer) - 1);
+    memcpy(buffer, token->start, length);
+    buffer[length] = '\0';
+    return g_ascii_strtod(buffer, NULL);
+}
+
+static guint64 token_to_uint(token_t *token) {
+    guint64 value = 0;
+    for(gsize i = 0; i < token->length && g_ascii_isdigit(token->start[i]); i++) {
+        value = value * 10 + (token->start[i] - '0');
+    }
+    return value;
+}
 
-    return lines;
+static gboolean token_is(token_t *token, const gchar *word) {
+    gsize length = strlen(word);
+    return token->length == length && !g_ascii_strncasecmp(token->start, word, length);
 }
 
-GHashTable *read_downloads(gchar *filename) {
-    gchar **lines = get_file_lines(filename);
-    if(!lines) {
+/* client names are interned into names */
+GHashTable *read_downloads(gchar *filename, GStringChunk *names) {
+    input_file_t input;
+    if(!input_file_open(&input, filename)) {
         return NULL;
     }
 
     GHashTable *downloads = g_hash_table_new(g_str_hash, g_str_equal);
-    for(gint idx = 0; lines[idx]; idx++) {
-        if(!g_ascii_strcasecmp(lines[idx], "")) {
-            continue;
-        }
-
-        gchar **parts = g_strsplit(lines[idx], " ", 0);
-        if(!parts[0] || !parts[1] || !parts[2]) {
-            g_warning("missing start time, stop time, or client hostname: '%s'", lines[idx]);
+    token_t parts[INPUT_MAX_TOKENS];
+    token_t line;
+    gint nparts;
+    while((nparts = input_file_next(&input, " ", parts, &line)) >= 0) {
+        if(nparts < 3) {
+            g_warning("missing start time, stop time, or client hostname: '%.*s'", (gint)line.length, line.start);
             continue;
         }
 
         download_t *download = g_new0(download_t, 1);
-        download->start_time = (gint)(g_ascii_strtod(parts[0], NULL) * 10) * 100;
-        download->end_time = (gint)(g_ascii_strtod(parts[1], NULL) * 10) * 100;
-        download->client = g_strdup(parts[2]);
+        download->start_time = (gint)(token_to_double(&parts[0]) * 10) * 100;
+        download->end_time = (gint)(token_to_double(&parts[1]) * 10) * 100;
+        download->client = input_file_intern(&input, names, &parts[2]);
 
         GQueue *client_downloads = g_hash_table_lookup(downloads, download->client);
         if(!client_downloads) {
@@ -167,270 +464,381 @@ GHashTable *read_downloads(gchar *filename) {
             g_hash_table_insert(downloads, download->client, client_downloads);
         }
         g_queue_push_tail(client_downloads, download);
-
-        g_strfreev(parts);
     }
-    g_strfreev(lines);
+    input_file_close(&input);
 
     return downloads;
 }
 
-GHashTable *read_relays(gchar *filename) {
-    gchar **lines = get_file_lines(filename);
-    if(!lines) {
+/* lines are "relay bandwidth [flags]", flags being Guard, Exit and family=NAME
+ * separated by spaces or commas.  If no line has flags every relay may be a
+ * guard and relays named like exits are exits.  relay_flags maps each relay
+ * to its RELAY_FLAG_* bits and family.  Relay names are interned into names */
+GHashTable *read_relays(gchar *filename, GHashTable *relay_flags, GStringChunk *names) {
+    input_file_t input;
+    if(!input_file_open(&input, filename)) {
         return NULL;
     }
 
-    GHashTable *relays = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-    for(gint idx = 0; lines[idx]; idx++) {
-        if(!g_ascii_strcasecmp(lines[idx], "")) {
-            continue;
-        }
+    GHashTable *relays = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable *families = g_hash_table_new(g_str_hash, g_str_equal);
+    gboolean flagged = FALSE;
 
-        gchar **relay_info = g_strsplit(lines[idx], " ", 0);
-        if(!relay_info[0] || !relay_info[1]) {
-            g_warning("no relay and bandwidth: '%s'", lines[idx]);
+    token_t relay_info[INPUT_MAX_TOKENS];
+    token_t line;
+    gint ninfo;
+    while((ninfo = input_file_next(&input, " ,", relay_info, &line)) >= 0) {
+        if(ninfo < 2) {
+            g_warning("no relay and bandwidth: '%.*s'", (gint)line.length, line.start);
             continue;
         }
 
-        gchar *relay = g_strdup(relay_info[0]);
-        gint bandwidth = g_ascii_strtoull(relay_info[1], NULL, 10);
+        gchar *relay = input_file_intern(&input, names, &relay_info[0]);
+        gint bandwidth = token_to_uint(&relay_info[1]);
+
+        guint flags = 0;
+        for(gint i = 2; i < MIN(ninfo, INPUT_MAX_TOKENS); i++) {
+            token_t *flag = &relay_info[i];
+
+            flagged = TRUE;
+            if(token_is(flag, "guard")) {
+                flags |= RELAY_FLAG_GUARD;
+            } else if(token_is(flag, "exit")) {
+                flags |= RELAY_FLAG_EXIT;
+            } else if(flag->length > 7 && !g_ascii_strncasecmp(flag->start, "family=", 7)) {
+                token_t name = {flag->start + 7, flag->length - 7};
+                gchar *family_name = input_file_intern(&input, names, &name);
+                gint family = GPOINTER_TO_INT(g_hash_table_lookup(families, family_name));
+                if(!family) {
+                    family = g_hash_table_size(families) + 1;
+                    g_hash_table_insert(families, family_name, GINT_TO_POINTER(family));
+                }
+                flags |= family << RELAY_FAMILY_SHIFT;
+            }
+        }
 
         g_hash_table_insert(relays, relay, GINT_TO_POINTER(bandwidth));
+        g_hash_table_insert(relay_flags, relay, GUINT_TO_POINTER(flags));
+    }
+    input_file_close(&input);
+    g_hash_table_destroy(families);
 
-        g_strfreev(relay_info);
+    if(!flagged) {
+        GHashTableIter iter;
+        gpointer key,value;
+
+        g_hash_table_iter_init(&iter, relays);
+        while(g_hash_table_iter_next(&iter, &key, &value)) {
+            guint flags = RELAY_FLAG_GUARD;
+            if(g_strstr_len((gchar *)key, -1, "exit")) {
+                flags |= RELAY_FLAG_EXIT;
+            }
+            g_hash_table_insert(relay_flags, key, GUINT_TO_POINTER(flags));
+        }
     }
-    g_strfreev(lines);
 
     return relays;
 }
 
-GQueue *read_circuits(gchar *filename, GHashTable *client_downloads) {
-    gchar **lines = get_file_lines(filename);
-    if(!lines) {
+/* relay and client names are interned into names, circuits are attached to
+ * downloads by assign_circuits once the downloads are read */
+GQueue *read_circuits(gchar *filename, GStringChunk *names) {
+    input_file_t input;
+    if(!input_file_open(&input, filename)) {
         return NULL;
     }
 
     GQueue *circuits = g_queue_new();
-    for(gint idx = 0; lines[idx]; idx++) {
-        if(!g_ascii_strcasecmp(lines[idx], "")) {
-            continue;
-        }
-
-        gchar **parts = g_strsplit(lines[idx], " ", 0);
-
-        gint nparts = 0;
-        while(parts[nparts]) {
-            nparts++;
-        }
-
+    token_t parts[INPUT_MAX_TOKENS];
+    token_t line;
+    gint nparts;
+    while((nparts = input_file_next(&input, " ", parts, &line)) >= 0) {
         if(nparts < 3) {
-            g_warning("missing guard, middle, or exit: '%s'", lines[idx]);
+            g_warning("missing guard, middle, or exit: '%.*s'", (gint)line.length, line.start);
             continue;
         }
 
         circuit_t *circuit = g_new0(circuit_t, 1);
-        circuit->guard = g_strdup(parts[0]);
-        circuit->middle = g_strdup(parts[1]);
-        circuit->exit = g_strdup(parts[2]);
+        circuit->guard = input_file_intern(&input, names, &parts[0]);
+        circuit->middle = input_file_intern(&input, names, &parts[1]);
+        circuit->exit = input_file_intern(&input, names, &parts[2]);
 
         if(nparts > 3) {
-            circuit->client = g_strdup(parts[3]);
+            circuit->client = input_file_intern(&input, names, &parts[3]);
         }
 
         if(nparts > 4) {
-            circuit->start_time = g_ascii_strtod(parts[4], NULL) * 1000;
+            circuit->start_time = token_to_double(&parts[4]) * 1000;
         }
 
         if(nparts > 5) {
-            circuit->end_time = g_ascii_strtod(parts[5], NULL) * 1000;
+            circuit->end_time = token_to_double(&parts[5]) * 1000;
         }
 
-        /* if the circuit is assigned to a specific client, find all the downloads
-         * which can potentially use the circuit based on start/end times */
-        if(circuit->client) {
-            GQueue *downloads = g_hash_table_lookup(client_downloads, circuit->client);
-            if(!downloads) {
-                g_warning("no downloads for client %s", circuit->client);
-                continue;
-            }
-
-            for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
-                download_t *download = (download_t *)iter->data;
-                if((!circuit->start_time || circuit->start_time <= download->start_time) &&
-                   (!circuit->end_time || circuit->end_time >= download->end_time)) {
+        g_queue_push_tail(circuits, circuit);
+    }
+    input_file_close(&input);
 
-                    if(!download->circuits) {
-                        download->circuits = g_queue_new();
-                    }
-                    g_queue_push_tail(download->circuits, circuit);
-                }
-            }
-        }
+    return circuits;
+}
 
-        g_queue_push_tail(circuits, circuit);
+/* a client's downloads sorted by start time over the leaves of a tree holding
+ * the earliest end time under each node, so the downloads lying within an
+ * interval are found in O(log n + k) */
+typedef struct interval_index_s {
+    gint ndownloads;
+    download_t **downloads;
+    gint nleaves;
+    gint *min_end;
+} interval_index_t;
+
+static interval_index_t *interval_index_new(GQueue *downloads) {
+    interval_index_t *index = g_new0(interval_index_t, 1);
+    index->ndownloads = g_queue_get_length(downloads);
+    index->downloads = g_new(download_t *, index->ndownloads);
+
+    GQueue *sorted = g_queue_copy(downloads);
+    g_queue_sort(sorted, (GCompareDataFunc)compare_download_by_start, NULL);
+    gint idx = 0;
+    for(GList *iter = g_queue_peek_head_link(sorted); iter; iter = g_list_next(iter)) {
+        index->downloads[idx++] = (download_t *)iter->data;
+    }
+    g_queue_free(sorted);
 
-        g_strfreev(parts);
+    index->nleaves = 1;
+    while(index->nleaves < index->ndownloads) {
+        index->nleaves *= 2;
+    }
+    index->min_end = g_new(gint, 2 * index->nleaves);
+    for(gint i = 0; i < index->nleaves; i++) {
+        index->min_end[index->nleaves + i] = i < index->ndownloads ? index->downloads[i]->end_time : G_MAXINT;
+    }
+    for(gint node = index->nleaves - 1; node > 0; node--) {
+        index->min_end[node] = MIN(index->min_end[2 * node], index->min_end[2 * node + 1]);
     }
-    g_strfreev(lines);
 
-    return circuits;
+    return index;
 }
 
-GQueue *get_all_downloads(GHashTable *client_downloads) {
-    g_assert(client_downloads);
+static void interval_index_free(interval_index_t *index) {
+    g_free(index->downloads);
+    g_free(index->min_end);
+    g_free(index);
+}
 
-    GQueue *downloads = g_queue_new();
+/* downloads from sorted position first on ending by end in the subtree of
+ * node, which covers positions low up to high */
+static void interval_index_report(interval_index_t *index, gint node, gint low, gint high, gint first,
+        gdouble end, circuit_t *circuit) {
+    if(high <= first || low >= index->ndownloads || index->min_end[node] > end) {
+        return;
+    }
 
-    GList *download_lists = g_hash_table_get_values(client_downloads);
-    for(GList *iter = download_lists; iter; iter = g_list_next(iter)) {
-        GQueue *list = (GQueue*)iter->data;
-        for(GList *iter2 = g_queue_peek_head_link(list); iter2; iter2 = g_list_next(iter2)) {
-            download_t *download = (download_t *)iter2->data;
-            g_queue_push_tail(downloads, download);
+    if(node >= index->nleaves) {
+        download_t *download = index->downloads[low];
+        if(circuit) {
+            download->circuit_list[download->ncircuits] = circuit;
         }
+        download->ncircuits++;
+        return;
     }
-    g_list_free(download_lists);
 
-    return downloads;
+    gint middle = low + (high - low) / 2;
+    interval_index_report(index, 2 * node, low, middle, first, end, circuit);
+    interval_index_report(index, 2 * node + 1, middle, high, first, end, circuit);
 }
 
-GQueue *build_all_circuits(GHashTable *relays) {
-    g_assert(relays);
+/* counts the circuit in or, given one, appends it to every download of the
+ * client lying within the circuit's lifetime */
+static void interval_index_attach(interval_index_t *index, circuit_t *circuit, gboolean fill) {
+    gint first = 0;
+    if(circuit->start_time) {
+        gint high = index->ndownloads;
+        while(first < high) {
+            gint middle = first + (high - first) / 2;
+            if(index->downloads[middle]->start_time < circuit->start_time) {
+                first = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+    }
 
-    GList *relay_list = g_hash_table_get_keys(relays);
-    gint nrelays = g_hash_table_size(relays);
+    gdouble end = circuit->end_time ? circuit->end_time : G_MAXINT;
+    interval_index_report(index, 1, 0, index->nleaves, first, end, fill ? circuit : NULL);
+}
 
-    /* construct a list of all circuits */
-    GQueue *circuits = g_queue_new();
-    for(gint i = 0; i < nrelays - 2; i++) {
-        for(gint j = i + 1; j < nrelays - 1; j++) {
-            for(gint k = j + 1; k < nrelays; k++) {
-                gchar *relay1 = (gchar *)g_list_nth_data(relay_list, i);
-                gchar *relay2 = (gchar *)g_list_nth_data(relay_list, j);
-                gchar *relay3 = (gchar *)g_list_nth_data(relay_list, k);
-                gint bw1 = GPOINTER_TO_INT(g_hash_table_lookup(relays, relay1));
-                gint bw2 = GPOINTER_TO_INT(g_hash_table_lookup(relays, relay2));
-                gint bw3 = GPOINTER_TO_INT(g_hash_table_lookup(relays, relay3));
-
-                circuit_t *circuit = g_new0(circuit_t, 1);
-                circuit->bandwidth = MIN(bw1, MIN(bw2, bw3));
-
-                /* make sure one of the relay_list is an exit */
-                if(g_strstr_len(relay3, -1, "exit")) {
-                    circuit->guard = relay1;
-                    circuit->middle = relay2;
-                    circuit->exit = relay3;
-                    g_queue_push_tail(circuits, circuit);
-                } else if(g_strstr_len(relay2, -1, "exit")) {
-                    circuit->guard = relay1;
-                    circuit->middle = relay3;
-                    circuit->exit = relay2;
-                    g_queue_push_tail(circuits, circuit);
-                } else if(g_strstr_len(relay1, -1, "exit")) {
-                    circuit->guard = relay2;
-                    circuit->middle = relay3;
-                    circuit->exit = relay1;
-                    g_queue_push_tail(circuits, circuit);
-                } else {
+/* if a circuit is assigned to a specific client, find all the downloads which
+ * can potentially use the circuit based on start/end times.  Each such
+ * download gets its circuits, in file order, as a span of the returned array.
+ * Circuits of clients without downloads are dropped */
+circuit_t **assign_circuits(GQueue *circuits, GHashTable *client_downloads) {
+    GHashTable *indexes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)interval_index_free);
+    GQueue *assigned = g_queue_new();
+
+    /* count each download's circuits */
+    GList *iter = g_queue_peek_head_link(circuits);
+    while(iter) {
+        GList *next = g_list_next(iter);
+        circuit_t *circuit = (circuit_t *)iter->data;
+
+        if(circuit->client) {
+            interval_index_t *index = g_hash_table_lookup(indexes, circuit->client);
+            if(!index) {
+                GQueue *downloads = g_hash_table_lookup(client_downloads, circuit->client);
+                if(!downloads) {
+                    g_warning("no downloads for client %s", circuit->client);
+                    g_queue_delete_link(circuits, iter);
                     g_free(circuit);
+                    iter = next;
+                    continue;
                 }
+                index = interval_index_new(downloads);
+                g_hash_table_insert(indexes, circuit->client, index);
             }
+
+            interval_index_attach(index, circuit, FALSE);
+            g_queue_push_tail(assigned, circuit);
         }
+
+        iter = next;
     }
 
-    g_list_free(relay_list);
+    /* lay out the spans, then fill them in circuit order */
+    gsize total = 0;
+    GHashTableIter indexes_iter;
+    gpointer key,value;
+    g_hash_table_iter_init(&indexes_iter, indexes);
+    while(g_hash_table_iter_next(&indexes_iter, &key, &value)) {
+        interval_index_t *index = (interval_index_t *)value;
+        for(gint i = 0; i < index->ndownloads; i++) {
+            total += index->downloads[i]->ncircuits;
+        }
+    }
 
-    return circuits;
-}
+    circuit_t **spans = g_new(circuit_t *, MAX(total, 1));
+    gsize offset = 0;
+    g_hash_table_iter_init(&indexes_iter, indexes);
+    while(g_hash_table_iter_next(&indexes_iter, &key, &value)) {
+        interval_index_t *index = (interval_index_t *)value;
+        for(gint i = 0; i < index->ndownloads; i++) {
+            download_t *download = index->downloads[i];
+            if(download->ncircuits) {
+                download->circuit_list = &spans[offset];
+                offset += download->ncircuits;
+                download->ncircuits = 0;
+            }
+        }
+    }
 
-static gint compare_relay_by_bw(gconstpointer a, gconstpointer b, gpointer user_data) {
-    gchar *relay1 = (gchar *)a;
-    gchar *relay2 = (gchar *)b;
+    for(GList *iter = g_queue_peek_head_link(assigned); iter; iter = g_list_next(iter)) {
+        circuit_t *circuit = (circuit_t *)iter->data;
+        interval_index_attach(g_hash_table_lookup(indexes, circuit->client), circuit, TRUE);
+    }
 
-    GHashTable *relay_bandwidth = (GHashTable *)user_data;
-    gint bw1 = GPOINTER_TO_INT(g_hash_table_lookup(relay_bandwidth, relay1));
-    gint bw2 = GPOINTER_TO_INT(g_hash_table_lookup(relay_bandwidth, relay2));
+    g_queue_free(assigned);
+    g_hash_table_destroy(indexes);
 
-    return bw2 - bw1;
+    return spans;
 }
 
-GQueue *build_pruned_circuits(GHashTable *relays) {
-    g_assert(relays);
+/* the input files read on separate executor workers, each into its own names
+ * chunk since string chunks are not thread safe */
+typedef struct input_data_s {
+    gchar *filenames[3];
+    GStringChunk *names[3];
+    GHashTable *client_downloads;
+    GHashTable *relays;
+    GHashTable *relay_flags;
+    GQueue *circuits;
+} input_data_t;
+
+static void read_input_worker(gint start, gint end, gpointer user_data) {
+    input_data_t *data = (input_data_t *)user_data;
+
+    for(gint idx = start; idx < end; idx++) {
+        switch(idx) {
+            case 0:
+                data->client_downloads = read_downloads(data->filenames[0], data->names[0]);
+                break;
+            case 1:
+                data->relays = read_relays(data->filenames[1], data->relay_flags, data->names[1]);
+                break;
+            case 2:
+                data->circuits = read_circuits(data->filenames[2], data->names[2]);
+                break;
+        }
+    }
+}
 
-    GHashTable *relay_bandwidth = g_hash_table_new(g_str_hash, g_str_equal);
-    GQueue *relays_remaining = g_queue_new();
+GQueue *get_all_downloads(GHashTable *client_downloads) {
+    g_assert(client_downloads);
 
-    GHashTableIter iter;
-    gpointer key,value;
+    GQueue *downloads = g_queue_new();
 
-    g_hash_table_iter_init(&iter, relays);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        g_hash_table_insert(relay_bandwidth, key, value);
-        g_queue_push_head(relays_remaining, key);
+    GList *download_lists = g_hash_table_get_values(client_downloads);
+    for(GList *iter = download_lists; iter; iter = g_list_next(iter)) {
+        GQueue *list = (GQueue*)iter->data;
+        for(GList *iter2 = g_queue_peek_head_link(list); iter2; iter2 = g_list_next(iter2)) {
+            download_t *download = (download_t *)iter2->data;
+            g_queue_push_tail(downloads, download);
+        }
     }
+    g_list_free(download_lists);
 
-    GQueue *circuits = g_queue_new();
-    while(g_queue_get_length(relays_remaining) >= 3) {
-        g_queue_sort(relays_remaining, (GCompareDataFunc)compare_relay_by_bw, relay_bandwidth);
+    return downloads;
+}
 
-        gchar *relay1 = g_queue_pop_head(relays_remaining);
-        gchar *relay2 = g_queue_pop_head(relays_remaining);
+/* relays in the same family cannot share a circuit */
+static gboolean relays_related(guint flags1, guint flags2) {
+    return RELAY_FAMILY(flags1) && RELAY_FAMILY(flags1) == RELAY_FAMILY(flags2);
+}
 
-        gchar *relay3 = NULL;
-        if(g_strstr_len(relay1, -1, "exit") || g_strstr_len(relay2, -1, "exit")) {
-            relay3 = g_queue_pop_head(relays_remaining);
-        } else {
-            gint idx = 0;
-            for(GList *iter = g_queue_peek_head_link(relays_remaining); iter && !relay3; iter = g_list_next(iter)) {
-                gchar *relay = iter->data;
-                if(g_strstr_len(relay, -1, "exit")) {
-                    relay3 = g_queue_pop_nth(relays_remaining, idx);
-                }
-                idx++;
-            }
-        }
+/* drops the circuits read in that put two relays of one family together */
+static void drop_related_circuits(GQueue *circuits, GHashTable *relay_flags) {
+    GList *iter = g_queue_peek_head_link(circuits);
+    while(iter) {
+        GList *next = g_list_next(iter);
+        circuit_t *circuit = iter->data;
 
-        if(!relay3) {
-            break;
+        guint guard = GPOINTER_TO_UINT(g_hash_table_lookup(relay_flags, circuit->guard));
+        guint middle = GPOINTER_TO_UINT(g_hash_table_lookup(relay_flags, circuit->middle));
+        guint exit = GPOINTER_TO_UINT(g_hash_table_lookup(relay_flags, circuit->exit));
+        if(relays_related(guard, middle) || relays_related(guard, exit) || relays_related(middle, exit)) {
+            g_warning("dropping circuit %s %s %s, two of its relays are in one family",
+                    circuit->guard, circuit->middle, circuit->exit);
+            g_queue_delete_link(circuits, iter);
+            g_free(circuit);
         }
+        iter = next;
+    }
+}
 
-        gint bw1 = GPOINTER_TO_INT(g_hash_table_lookup(relay_bandwidth, relay1));
-        gint bw2 = GPOINTER_TO_INT(g_hash_table_lookup(relay_bandwidth, relay2));
-        gint bw3 = GPOINTER_TO_INT(g_hash_table_lookup(relay_bandwidth, relay3));
+/* order the three relays as guard, middle and exit: the exit is the last relay
+ * flagged exit that leaves a guard among the other two, the guard the first of
+ * those flagged guard.  FALSE if the relays cannot make a circuit */
+static gboolean place_circuit(const guint *flags, gint *order) {
+    for(gint exit = 2; exit >= 0; exit--) {
+        if(!(flags[exit] & RELAY_FLAG_EXIT)) {
+            continue;
+        }
 
-        circuit_t *circuit = g_new0(circuit_t, 1);
-        circuit->bandwidth = MIN(bw1, MIN(bw2, bw3));
-
-        g_hash_table_insert(relay_bandwidth, relay1, GINT_TO_POINTER(bw1 - circuit->bandwidth));
-        g_hash_table_insert(relay_bandwidth, relay2, GINT_TO_POINTER(bw2 - circuit->bandwidth));
-        g_hash_table_insert(relay_bandwidth, relay3, GINT_TO_POINTER(bw3 - circuit->bandwidth));
-
-        /* make sure one of the relay_list is an exit */
-        if(g_strstr_len(relay3, -1, "exit")) {
-            circuit->guard = relay1;
-            circuit->middle = relay2;
-            circuit->exit = relay3;
-            g_queue_push_tail(circuits, circuit);
-        } else if(g_strstr_len(relay2, -1, "exit")) {
-            circuit->guard = relay1;
-            circuit->middle = relay3;
-            circuit->exit = relay2;
-            g_queue_push_tail(circuits, circuit);
-        } else if(g_strstr_len(relay1, -1, "exit")) {
-            circuit->guard = relay2;
-            circuit->middle = relay3;
-            circuit->exit = relay1;
-            g_queue_push_tail(circuits, circuit);
-        } else {
-            g_warning("should be exit, none found with relays %s %s %s", relay1, relay2, relay3);
+        gint other1 = exit == 0 ? 1 : 0;
+        gint other2 = exit == 2 ? 1 : 2;
+        if(flags[other1] & RELAY_FLAG_GUARD) {
+            order[0] = other1;
+            order[1] = other2;
+            order[2] = exit;
+            return TRUE;
+        }
+        if(flags[other2] & RELAY_FLAG_GUARD) {
+            order[0] = other2;
+            order[1] = other1;
+            order[2] = exit;
+            return TRUE;
         }
     }
-
-    g_hash_table_destroy(relay_bandwidth);
-    g_queue_free(relays_remaining);
-
-    return circuits;
+    return FALSE;
 }
 
 GQueue *get_download_ticks(GQueue *downloads) {
@@ -470,545 +878,3401 @@ GHashTable *generate_downloads_by_tick(GQueue *downloads) {
     return downloads_by_tick;
 }
 
-void generate_circuit_lists(GQueue *circuits, circuit_t ***circuit_list, 
-        circuit_t ***weighted_circuit_list, gint *total_circuit_bandwidth) {
-    g_assert(circuits);
-
-    *circuit_list = (circuit_t **)g_new0(gpointer, g_queue_get_length(circuits));
-    circuit_t **list = *circuit_list;
-
-    *total_circuit_bandwidth = 0;
+/*
+ * Implicit catalog of all circuits
+ */
 
-    gint idx = 0;
-    for(GList *iter = g_queue_peek_head_link(circuits); iter; iter = g_list_next(iter)) {
-        circuit_t *circuit = iter->data;
-        list[idx] = circuit;
-        idx++;
+#define CLASS_MASK(roles) (1u << (roles))
+#define CLASS_ALL 0xfu
+#define CLASS_NEITHER CLASS_MASK(0)
+#define CLASS_GUARD CLASS_MASK(RELAY_FLAG_GUARD)
+#define CLASS_EXIT CLASS_MASK(RELAY_FLAG_EXIT)
+#define CLASS_GUARD_EXIT CLASS_MASK(RELAY_FLAG_GUARD | RELAY_FLAG_EXIT)
+
+/* every triple, less those with no exit, those whose exits are not guards and
+ * whose other relays are neither, and a guard exit with two relays that are
+ * neither, which leaves exactly the triples place_circuit accepts */
+static const struct {
+    gint sign;
+    guint first;
+    guint rest;
+} catalog_kinds[CATALOG_MAX_TERMS] = {
+    { 1, CLASS_ALL, CLASS_ALL },
+    { -1, CLASS_NEITHER | CLASS_GUARD, CLASS_NEITHER | CLASS_GUARD },
+    { -1, CLASS_NEITHER | CLASS_EXIT, CLASS_NEITHER | CLASS_EXIT },
+    { 1, CLASS_NEITHER, CLASS_NEITHER },
+    { -1, CLASS_GUARD_EXIT, CLASS_NEITHER },
+};
+
+static gboolean catalog_in(circuit_catalog_t *catalog, guint mask, gint position) {
+    return (mask & CLASS_MASK(catalog->relay_flags[position] & RELAY_ROLES)) != 0;
+}
 
-        gint bw = MAX((gint)(circuit->bandwidth / 1024.0), 1);
-        *total_circuit_bandwidth += bw;
-    }
+static gboolean catalog_roles_valid(guint roles1, guint roles2, guint roles3) {
+    guint flags[3] = {roles1, roles2, roles3};
+    gint order[3];
+    return place_circuit(flags, order);
+}
 
-    /*g_message("total circuit bandwidth %d", *total_circuit_bandwidth);*/
+/* guard only, guard exit, neither, exit only: the last kind of catalog_kinds
+ * only has its first relay before the others in this order */
+static gint role_rank(guint flags) {
+    static const gint rank[4] = {2, 0, 3, 1};
+    return rank[flags & RELAY_ROLES];
+}
 
-    *weighted_circuit_list = (circuit_t **)g_new0(gpointer, *total_circuit_bandwidth);
-    circuit_t **weighted_list = *weighted_circuit_list;
+static gint compare_position_by_role(gconstpointer p1, gconstpointer p2, gpointer user_data) {
+    circuit_catalog_t *catalog = (circuit_catalog_t *)user_data;
+    gint position1 = *(gint *)p1;
+    gint position2 = *(gint *)p2;
+    gint rank1 = role_rank(catalog->relay_flags[position1]);
+    gint rank2 = role_rank(catalog->relay_flags[position2]);
 
-    idx = 0;
-    for(gint i = 0; i < g_queue_get_length(circuits); i++) {
-        gint bw = MAX((gint)(list[i]->bandwidth / 1024.0), 1);
-        for(gint j = 0; j < bw; j++) {
-            weighted_list[idx++] = list[i];
-        }
+    if(rank1 != rank2) {
+        return rank1 - rank2;
     }
+    return position1 - position2;
 }
 
-void write_circuits_to_file(GQueue *downloads, GHashTable *circuit_selection, gchar *filename) {
-    GString *content = g_string_new("");
-    for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
-        download_t *download = iter->data;
-        circuit_t *circuit = g_hash_table_lookup(circuit_selection, download);
-        g_string_append_printf(content, "%s %f %f %s %s %s\n", download->client,
-                download->start_time / 1000.0, download->end_time / 1000.0,
-                circuit->guard, circuit->middle, circuit->exit);
-    }
+static gint compare_position_by_bw(gconstpointer p1, gconstpointer p2, gpointer user_data) {
+    circuit_catalog_t *catalog = (circuit_catalog_t *)user_data;
+    gint position1 = *(gint *)p1;
+    gint position2 = *(gint *)p2;
+    gint bw1 = catalog->relay_bandwidth[position1];
+    gint bw2 = catalog->relay_bandwidth[position2];
 
-    GError *error = NULL;
-    if(!g_file_set_contents(filename, content->str, content->len, &error)) {
-        g_error("[ERROR] g_file_set_contents: %s", error->message);
-        g_error_free(error);
+    if(bw1 != bw2) {
+        return bw1 < bw2 ? -1 : 1;
     }
-
-    g_string_free(content, TRUE);
+    return position1 - position2;
 }
 
+/* pairs after sorted index s of role classes c1 <= c2 that complete a circuit with it */
+static gint64 catalog_class_pairs(circuit_catalog_t *catalog, gint s, gint c1, gint c2) {
+    guint roles = catalog->relay_flags[catalog->by_bandwidth[s]] & RELAY_ROLES;
+    if(!catalog_roles_valid(roles, c1, c2)) {
+        return 0;
+    }
 
-/*
- * Calculate bandwidth of each circuit
- */
-
-void update_active_relay(GHashTable *relay_downloads, GHashTable *active_relays, gchar *relay, download_t *download, gint bandwidth) {
-    g_assert(relay_downloads);
-    g_assert(active_relays);
-    g_assert(relay);
+    gint n = catalog->nrelays;
+    gint64 after1 = catalog->class_before[c1][n] - catalog->class_before[c1][s + 1];
+    gint64 after2 = catalog->class_before[c2][n] - catalog->class_before[c2][s + 1];
+    return c1 == c2 ? after1 * (after1 - 1) / 2 : after1 * after2;
+}
 
-    GHashTable *downloads = g_hash_table_lookup(relay_downloads, relay);
-    if(!downloads) {
-        downloads = g_hash_table_new(g_direct_hash, g_direct_equal);
-        g_hash_table_insert(relay_downloads, relay, downloads);
+/* catalog over n relays taken as positions in the given order, reordered by
+ * role where needed.  Catalogs built from their own position order come out
+ * the same */
+circuit_catalog_t *circuit_catalog_new_ordered(gint n, gchar **names, gint *bandwidth, guint *flags) {
+    circuit_catalog_t *catalog = g_new0(circuit_catalog_t, 1);
+    catalog->nrelays = n;
+
+    gint *order = g_new(gint, n);
+    gboolean have_guard_exit = FALSE;
+    gboolean have_neither = FALSE;
+
+    for(gint p = 0; p < n; p++) {
+        order[p] = p;
+        have_guard_exit |= (flags[p] & RELAY_ROLES) == RELAY_ROLES;
+        have_neither |= (flags[p] & RELAY_ROLES) == 0;
     }
-    g_hash_table_insert(downloads, download, GINT_TO_POINTER(TRUE));
 
-    if(!g_hash_table_lookup(active_relays, relay)) {
-        gdouble *bw = g_new0(gdouble, 1);
-        *bw = (gdouble)bandwidth;
-        g_hash_table_insert(active_relays, relay, bw);
+    catalog->relay_flags = flags;
+    if(have_guard_exit && have_neither) {
+        g_qsort_with_data(order, n, sizeof(gint), compare_position_by_role, catalog);
     }
-}
 
-void update_relays(GHashTable *active_relays, gchar *relay, gdouble download_bandwidth) {
-    g_assert(active_relays);
-    g_assert(relay);
-
-    gdouble *relays = (gdouble *)(g_hash_table_lookup(active_relays, relay));
-    *relays -= download_bandwidth;
-    if(*relays < 0.000001) {
-        g_debug("removing relay %s from list with bandwidth %f", relay, *relays);
-        g_hash_table_remove(active_relays, relay);
+    catalog->relay_names = g_new(gchar *, n);
+    catalog->relay_bandwidth = g_new(gint, n);
+    catalog->relay_flags = g_new(guint, n);
+    catalog->relays = g_new(gint, n);
+    for(gint p = 0; p < n; p++) {
+        catalog->relay_names[p] = names[order[p]];
+        catalog->relay_bandwidth[p] = bandwidth[order[p]];
+        catalog->relay_flags[p] = flags[order[p]];
+        catalog->relays[p] = -1;
     }
-}
+    g_free(order);
+
+    /* triples of a term starting at position p: C(rest after, 2), and pairs: rest after */
+    gint64 ncircuits = 0;
+    for(gint t = 0; t < CATALOG_MAX_TERMS; t++) {
+        catalog_term_t *term = &catalog->terms[catalog->nterms];
+        term->sign = catalog_kinds[t].sign;
+        term->first = catalog_kinds[t].first;
+        term->rest = catalog_kinds[t].rest;
+        term->count = g_new0(gint, n + 1);
+        term->pair_prefix = g_new0(gint64, n + 1);
+        term->single_prefix = g_new0(gint64, n + 1);
+
+        for(gint p = 0; p < n; p++) {
+            term->count[p + 1] = term->count[p] + catalog_in(catalog, term->rest, p);
+        }
+        for(gint p = 0; p < n; p++) {
+            gint64 after = term->count[n] - term->count[p + 1];
+            term->pair_prefix[p + 1] = term->pair_prefix[p] +
+                (catalog_in(catalog, term->first, p) ? after * (after - 1) / 2 : 0);
+            term->single_prefix[p + 1] = term->single_prefix[p] +
+                (catalog_in(catalog, term->rest, p) ? after : 0);
+        }
 
-void remove_download_from_relay(GHashTable *relay_downloads, gchar *relay, download_t *download) {
-    g_assert(relay_downloads);
-    g_assert(relay);
-    g_assert(download);
+        /* kinds with no triples are dropped so they cost nothing per lookup */
+        if(term->pair_prefix[n]) {
+            ncircuits += term->sign * term->pair_prefix[n];
+            catalog->nterms++;
+        } else {
+            g_free(term->count);
+            g_free(term->pair_prefix);
+            g_free(term->single_prefix);
+        }
+    }
 
-    GHashTable *downloads = g_hash_table_lookup(relay_downloads, relay);
-    if(!download) {
-        g_error("relay %s had no download list", relay);
-        return;
+    if(ncircuits > G_MAXINT) {
+        g_error("%d relays make %" G_GINT64_FORMAT " circuits, more than can be indexed", n, ncircuits);
     }
+    catalog->ncircuits = (gint)ncircuits;
+
+    /* a circuit's bandwidth is that of its slowest relay, so with relays sorted
+     * by bandwidth the circuits whose slowest relay is s are s with any pair
+     * after it that completes a circuit, all of them weighing the same */
+    catalog->by_bandwidth = g_new(gint, n);
+    for(gint p = 0; p < n; p++) {
+        catalog->by_bandwidth[p] = p;
+    }
+    g_qsort_with_data(catalog->by_bandwidth, n, sizeof(gint), compare_position_by_bw, catalog);
 
-    if(!g_hash_table_remove(downloads, download)) {
-        g_error("error removing download %p from relay %s", download, relay);
+    gint nclass[4] = {0, 0, 0, 0};
+    for(gint c = 0; c < 4; c++) {
+        catalog->sorted[c] = g_new(gint, n);
+        catalog->class_before[c] = g_new0(gint, n + 1);
+    }
+    for(gint s = 0; s < n; s++) {
+        gint c = catalog->relay_flags[catalog->by_bandwidth[s]] & RELAY_ROLES;
+        catalog->sorted[c][nclass[c]++] = s;
+        for(gint c2 = 0; c2 < 4; c2++) {
+            catalog->class_before[c2][s + 1] = nclass[c2];
+        }
     }
 
-    if(g_hash_table_size(downloads) == 0) {
-        g_debug("removing %s from downloads", relay);
-        g_hash_table_destroy(downloads);
-        g_hash_table_remove(relay_downloads, relay);
+    catalog->draw_weight = g_new(gint64, n);
+    gint64 total_weight = 0;
+    for(gint s = 0; s < n; s++) {
+        gint64 npairs = 0;
+        for(gint c1 = 0; c1 < 4; c1++) {
+            for(gint c2 = c1; c2 < 4; c2++) {
+                npairs += catalog_class_pairs(catalog, s, c1, c2);
+            }
+        }
+        total_weight += npairs * MAX((gint)(catalog->relay_bandwidth[catalog->by_bandwidth[s]] / 1024.0), 1);
+        catalog->draw_weight[s] = total_weight;
     }
+
+    return catalog;
 }
 
-gdouble compute_download_bandwidths(GHashTable *active_downloads, GHashTable *relays, GHashTable *circuit_selection, GHashTable *weights, GHashTable *available_bandwidth) {
+circuit_catalog_t *circuit_catalog_new(GHashTable *relays, GHashTable *relay_flags) {
     g_assert(relays);
+    g_assert(relay_flags);
 
-    GHashTableIter iter;
-    gpointer key,value;
+    gint n = g_hash_table_size(relays);
+    gchar **names = g_new(gchar *, n);
+    gint *bandwidth = g_new(gint, n);
+    guint *flags = g_new(guint, n);
 
-    GHashTable *active_relays = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
-    GHashTable *relay_downloads = g_hash_table_new(g_str_hash, g_str_equal);
+    GList *relay_list = g_hash_table_get_keys(relays);
+    gint p = 0;
+    for(GList *iter = relay_list; iter; iter = g_list_next(iter), p++) {
+        names[p] = (gchar *)iter->data;
+        bandwidth[p] = GPOINTER_TO_INT(g_hash_table_lookup(relays, names[p]));
+        flags[p] = GPOINTER_TO_UINT(g_hash_table_lookup(relay_flags, names[p]));
+    }
+    g_list_free(relay_list);
 
-    /* 1. Build mapping of relay and all active downloads */
-    g_hash_table_iter_init(&iter, active_downloads);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        download_t *download = (download_t *)key;
-        circuit_t *circuit = g_hash_table_lookup(circuit_selection, download);
-        g_debug("download from %f to %f active on circuit %s,%s,%s",
-                download->start_time / 1000.0, download->end_time / 1000.0,
-                circuit->guard, circuit->middle, circuit->exit);
+    circuit_catalog_t *catalog = circuit_catalog_new_ordered(n, names, bandwidth, flags);
 
-        gint bandwidth;
+    g_free(names);
+    g_free(bandwidth);
+    g_free(flags);
 
-        bandwidth = GPOINTER_TO_INT(g_hash_table_lookup(relays, circuit->guard));
-        update_active_relay(relay_downloads, active_relays, circuit->guard, download, bandwidth);
+    return catalog;
+}
 
-        bandwidth = GPOINTER_TO_INT(g_hash_table_lookup(relays, circuit->middle));
-        update_active_relay(relay_downloads, active_relays, circuit->middle, download, bandwidth);
+void circuit_catalog_free(circuit_catalog_t *catalog) {
+    for(gint t = 0; t < catalog->nterms; t++) {
+        g_free(catalog->terms[t].count);
+        g_free(catalog->terms[t].pair_prefix);
+        g_free(catalog->terms[t].single_prefix);
+    }
+    for(gint c = 0; c < 4; c++) {
+        g_free(catalog->sorted[c]);
+        g_free(catalog->class_before[c]);
+    }
+    g_free(catalog->relay_names);
+    g_free(catalog->relay_bandwidth);
+    g_free(catalog->relay_flags);
+    g_free(catalog->relays);
+    g_free(catalog->by_bandwidth);
+    g_free(catalog->draw_weight);
+    g_free(catalog);
+}
 
-        bandwidth = GPOINTER_TO_INT(g_hash_table_lookup(relays, circuit->exit));
-        update_active_relay(relay_downloads, active_relays, circuit->exit, download, bandwidth);
+/* circuits whose first position is before i, whose first is i and second is
+ * before j, and whose first two are i, j and third is before k */
+static gint64 catalog_first_before(circuit_catalog_t *catalog, gint i) {
+    gint64 n = 0;
+    for(gint t = 0; t < catalog->nterms; t++) {
+        n += catalog->terms[t].sign * catalog->terms[t].pair_prefix[i];
     }
+    return n;
+}
 
-    if(available_bandwidth) {
-        g_hash_table_iter_init(&iter, relays);
-        while(g_hash_table_iter_next(&iter, &key, &value)) {
-            gchar *relay = (gchar *)key;
-            if(!g_hash_table_lookup(active_relays, relay)) {
-                g_hash_table_insert(available_bandwidth, relay, value);
+static gint64 catalog_second_before(circuit_catalog_t *catalog, gint i, gint j) {
+    gint64 n = 0;
+    for(gint t = 0; t < catalog->nterms; t++) {
+        catalog_term_t *term = &catalog->terms[t];
+        if(catalog_in(catalog, term->first, i)) {
+            n += term->sign * (term->single_prefix[j] - term->single_prefix[i + 1]);
+        }
+    }
+    return n;
+}
+
+static gint64 catalog_third_before(circuit_catalog_t *catalog, gint i, gint j, gint k) {
+    gint64 n = 0;
+    for(gint t = 0; t < catalog->nterms; t++) {
+        catalog_term_t *term = &catalog->terms[t];
+        if(catalog_in(catalog, term->first, i) && catalog_in(catalog, term->rest, j)) {
+            n += term->sign * (term->count[k] - term->count[j + 1]);
+        }
+    }
+    return n;
+}
+
+/* guard, middle and exit positions of the relays on positions i < j < k as
+ * place_circuit orders them, FALSE if they make no circuit */
+static gboolean catalog_place(circuit_catalog_t *catalog, gint i, gint j, gint k, gint *placed) {
+    gint position[3] = {i, j, k};
+    guint flags[3] = {catalog->relay_flags[i], catalog->relay_flags[j], catalog->relay_flags[k]};
+    gint order[3];
+    if(!place_circuit(flags, order)) {
+        return FALSE;
+    }
+
+    for(gint n = 0; n < 3; n++) {
+        placed[n] = position[order[n]];
+    }
+    return TRUE;
+}
+
+/* index of the circuit on positions i < j < k and its guard, middle and exit
+ * relay ids, -1 if they make no circuit */
+gint circuit_catalog_lookup(circuit_catalog_t *catalog, gint i, gint j, gint k, gint *path) {
+    g_assert(i < j && j < k);
+
+    gint placed[3];
+    if(!catalog_place(catalog, i, j, k, placed)) {
+        return -1;
+    }
+
+    for(gint n = 0; n < 3; n++) {
+        path[n] = catalog->relays[placed[n]];
+    }
+
+    return catalog_first_before(catalog, i) + catalog_second_before(catalog, i, j) +
+        catalog_third_before(catalog, i, j, k);
+}
+
+/* positions i < j < k of a catalog circuit */
+static void catalog_unrank_triple(circuit_catalog_t *catalog, gint circuit, gint *triple) {
+    g_assert(circuit >= 0 && circuit < catalog->ncircuits);
+
+    gint64 rank = circuit;
+
+    /* each position is the last whose count of earlier circuits is within rank */
+    gint low = 0;
+    gint high = catalog->nrelays - 3;
+    while(low < high) {
+        gint mid = low + (high - low + 1) / 2;
+        if(catalog_first_before(catalog, mid) <= rank) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    gint i = low;
+    rank -= catalog_first_before(catalog, i);
+
+    low = i + 1;
+    high = catalog->nrelays - 2;
+    while(low < high) {
+        gint mid = low + (high - low + 1) / 2;
+        if(catalog_second_before(catalog, i, mid) <= rank) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    gint j = low;
+    rank -= catalog_second_before(catalog, i, j);
+
+    low = j + 1;
+    high = catalog->nrelays - 1;
+    while(low < high) {
+        gint mid = low + (high - low + 1) / 2;
+        if(catalog_third_before(catalog, i, j, mid) <= rank) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    gint k = low;
+
+    triple[0] = i;
+    triple[1] = j;
+    triple[2] = k;
+}
+
+/* guard, middle and exit relay ids of a catalog circuit */
+void circuit_catalog_unrank(circuit_catalog_t *catalog, gint circuit, gint *path) {
+    gint triple[3];
+    catalog_unrank_triple(catalog, circuit, triple);
+
+    gint found = circuit_catalog_lookup(catalog, triple[0], triple[1], triple[2], path);
+    g_assert(found == circuit);
+}
+
+/* TRUE if two of the relays on positions i < j < k are in one family.  The
+ * catalog counts such triples so indices stay cheap to compute, but they are
+ * never drawn or selected */
+static gboolean catalog_related(circuit_catalog_t *catalog, gint i, gint j, gint k) {
+    guint *flags = catalog->relay_flags;
+    return relays_related(flags[i], flags[j]) || relays_related(flags[i], flags[k]) ||
+        relays_related(flags[j], flags[k]);
+}
+
+gboolean circuit_catalog_related(circuit_catalog_t *catalog, gint circuit) {
+    gint triple[3];
+    catalog_unrank_triple(catalog, circuit, triple);
+    return catalog_related(catalog, triple[0], triple[1], triple[2]);
+}
+
+/* circuit drawn uniformly among those outside any family */
+gint circuit_catalog_draw_uniform(circuit_catalog_t *catalog, rng_t *rng) {
+    for(gint attempt = 0; attempt < CATALOG_MAX_DRAWS; attempt++) {
+        gint circuit = rng_int(rng, catalog->ncircuits);
+        if(!circuit_catalog_related(catalog, circuit)) {
+            return circuit;
+        }
+    }
+    g_error("no circuit found outside the relay families after %d draws", CATALOG_MAX_DRAWS);
+    return -1;
+}
+
+/* pair x < y of 0..n-1 at lexicographic index q */
+static void pair_unrank(gint64 q, gint n, gint *x, gint *y) {
+    gint low = 0;
+    gint high = n - 2;
+    while(low < high) {
+        gint mid = low + (high - low + 1) / 2;
+        if((gint64)mid * (2 * n - mid - 1) / 2 <= q) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    *x = low;
+    *y = low + 1 + (gint)(q - (gint64)low * (2 * n - low - 1) / 2);
+}
+
+/* circuit drawn with probability proportional to its weight, as the sampler
+ * over a materialized list would: pick the slowest relay by its total weight,
+ * then uniformly one of the pairs after it that completes a circuit.  -1 if
+ * two of the relays drawn are in one family */
+static gint catalog_draw_weighted(circuit_catalog_t *catalog, rng_t *rng) {
+    gint n = catalog->nrelays;
+    gint64 r = rng_int(rng, catalog->draw_weight[n - 1]);
+
+    gint low = 0;
+    gint high = n - 1;
+    while(low < high) {
+        gint mid = low + (high - low) / 2;
+        if(catalog->draw_weight[mid] > r) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    gint s = low;
+
+    gint position = catalog->by_bandwidth[s];
+    gint64 weight = MAX((gint)(catalog->relay_bandwidth[position] / 1024.0), 1);
+    gint64 pair = (r - (s ? catalog->draw_weight[s - 1] : 0)) / weight;
+
+    gint u = -1;
+    gint v = -1;
+    for(gint c1 = 0; c1 < 4 && u == -1; c1++) {
+        for(gint c2 = c1; c2 < 4 && u == -1; c2++) {
+            gint64 npairs = catalog_class_pairs(catalog, s, c1, c2);
+            if(pair >= npairs) {
+                pair -= npairs;
+                continue;
+            }
+
+            gint first1 = catalog->class_before[c1][s + 1];
+            gint first2 = catalog->class_before[c2][s + 1];
+            if(c1 == c2) {
+                pair_unrank(pair, catalog->class_before[c1][n] - first1, &u, &v);
+                u = catalog->sorted[c1][first1 + u];
+                v = catalog->sorted[c1][first1 + v];
+            } else {
+                gint64 after2 = catalog->class_before[c2][n] - first2;
+                u = catalog->sorted[c1][first1 + pair / after2];
+                v = catalog->sorted[c2][first2 + pair % after2];
+            }
+        }
+    }
+    g_assert(u != -1);
+
+    gint positions[3] = {position, catalog->by_bandwidth[u], catalog->by_bandwidth[v]};
+    gint i = MIN(positions[0], MIN(positions[1], positions[2]));
+    gint k = MAX(positions[0], MAX(positions[1], positions[2]));
+    gint j = positions[0] + positions[1] + positions[2] - i - k;
+    if(catalog_related(catalog, i, j, k)) {
+        return -1;
+    }
+
+    gint path[3];
+    return circuit_catalog_lookup(catalog, i, j, k, path);
+}
+
+/* weighted draw as above, drawing again whenever the circuit is within a family */
+gint circuit_catalog_draw(circuit_catalog_t *catalog, rng_t *rng) {
+    for(gint attempt = 0; attempt < CATALOG_MAX_DRAWS; attempt++) {
+        gint circuit = catalog_draw_weighted(catalog, rng);
+        if(circuit != -1) {
+            return circuit;
+        }
+    }
+    g_error("no circuit found outside the relay families after %d draws", CATALOG_MAX_DRAWS);
+    return -1;
+}
+
+/*
+ * Pruned circuit sets
+ *
+ * Relays are ranked once by bandwidth, most first, ties keeping the order the
+ * relays were read in reverse, and each strategy builds its circuits from
+ * that ranking.
+ */
+
+typedef struct prune_relays_s {
+    gint nrelays;
+    gchar **names;
+    gint *bandwidth;
+    guint *flags;
+} prune_relays_t;
+
+typedef GQueue *(*prune_func)(prune_relays_t *relays, GHashTable *relay_table, GHashTable *relay_flags,
+        gint count, guint64 seed);
+
+static gint compare_rank_by_bw(gconstpointer p1, gconstpointer p2, gpointer user_data) {
+    gint *bandwidth = (gint *)user_data;
+    gint rank1 = *(gint *)p1;
+    gint rank2 = *(gint *)p2;
+
+    if(bandwidth[rank1] != bandwidth[rank2]) {
+        return bandwidth[rank1] > bandwidth[rank2] ? -1 : 1;
+    }
+    return rank2 - rank1;
+}
+
+static prune_relays_t *prune_relays_new(GHashTable *relays, GHashTable *relay_flags) {
+    gint n = g_hash_table_size(relays);
+    gchar **names = g_new(gchar *, n);
+    gint *bandwidth = g_new(gint, n);
+    gint *order = g_new(gint, n);
+
+    GHashTableIter iter;
+    gpointer key,value;
+
+    gint idx = 0;
+    g_hash_table_iter_init(&iter, relays);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        names[idx] = (gchar *)key;
+        bandwidth[idx] = GPOINTER_TO_INT(value);
+        order[idx] = idx;
+        idx++;
+    }
+    g_qsort_with_data(order, n, sizeof(gint), compare_rank_by_bw, bandwidth);
+
+    prune_relays_t *ranked = g_new0(prune_relays_t, 1);
+    ranked->nrelays = n;
+    ranked->names = g_new(gchar *, n);
+    ranked->bandwidth = g_new(gint, n);
+    ranked->flags = g_new(guint, n);
+    for(gint r = 0; r < n; r++) {
+        ranked->names[r] = names[order[r]];
+        ranked->bandwidth[r] = bandwidth[order[r]];
+        ranked->flags[r] = GPOINTER_TO_UINT(g_hash_table_lookup(relay_flags, ranked->names[r]));
+    }
+
+    g_free(names);
+    g_free(bandwidth);
+    g_free(order);
+
+    return ranked;
+}
+
+static void prune_relays_free(prune_relays_t *relays) {
+    g_free(relays->names);
+    g_free(relays->bandwidth);
+    g_free(relays->flags);
+    g_free(relays);
+}
+
+/* circuit on relays of the given ranks, NULL if they make no circuit */
+static circuit_t *prune_circuit_new(prune_relays_t *relays, gint *ranks) {
+    guint flags[3];
+    for(gint i = 0; i < 3; i++) {
+        flags[i] = relays->flags[ranks[i]];
+    }
+    if(relays_related(flags[0], flags[1]) || relays_related(flags[0], flags[2]) ||
+            relays_related(flags[1], flags[2])) {
+        return NULL;
+    }
+
+    gint order[3];
+    if(!place_circuit(flags, order)) {
+        return NULL;
+    }
+
+    circuit_t *circuit = g_new0(circuit_t, 1);
+    circuit->bandwidth = MIN(relays->bandwidth[ranks[0]], MIN(relays->bandwidth[ranks[1]], relays->bandwidth[ranks[2]]));
+    circuit->guard = relays->names[ranks[order[0]]];
+    circuit->middle = relays->names[ranks[order[1]]];
+    circuit->exit = relays->names[ranks[order[2]]];
+    return circuit;
+}
+
+/* every relay joins at most one circuit: the two highest ranked unused relays
+ * outside each other's family and the highest ranked unused relay completing
+ * a circuit with them.  A relay's rank never changes, so each role class is a
+ * ranked list with a cursor past its used relays instead of a heap */
+static GQueue *prune_greedy(prune_relays_t *relays, GHashTable *relay_table, GHashTable *relay_flags,
+        gint count, guint64 seed) {
+    gint n = relays->nrelays;
+    gboolean *used = g_new0(gboolean, n);
+    gint *class_ranks[4];
+    gint nclass[4] = {0, 0, 0, 0};
+    gint cursor[4] = {0, 0, 0, 0};
+
+    for(gint c = 0; c < 4; c++) {
+        class_ranks[c] = g_new(gint, n);
+    }
+    for(gint r = 0; r < n; r++) {
+        gint c = relays->flags[r] & RELAY_ROLES;
+        class_ranks[c][nclass[c]++] = r;
+    }
+
+    GQueue *circuits = g_queue_new();
+    gint first = 0;
+    gint nremaining = n;
+    while(nremaining >= 3) {
+        while(used[first]) {
+            first++;
+        }
+
+        gint ranks[3] = {first, -1, -1};
+        for(gint r = first + 1; r < n && ranks[1] == -1; r++) {
+            if(!used[r] && !relays_related(relays->flags[r], relays->flags[first])) {
+                ranks[1] = r;
+            }
+        }
+        if(ranks[1] == -1) {
+            break;
+        }
+
+        /* best unused relay of each class that can complete the circuit */
+        guint roles1 = relays->flags[ranks[0]] & RELAY_ROLES;
+        guint roles2 = relays->flags[ranks[1]] & RELAY_ROLES;
+        for(gint c = 0; c < 4; c++) {
+            if(!catalog_roles_valid(roles1, roles2, c)) {
+                continue;
+            }
+            while(cursor[c] < nclass[c] && used[class_ranks[c][cursor[c]]]) {
+                cursor[c]++;
+            }
+            for(gint i = cursor[c]; i < nclass[c]; i++) {
+                gint r = class_ranks[c][i];
+                if(used[r] || r == ranks[1] || r == ranks[0] || relays_related(relays->flags[r], relays->flags[ranks[0]]) ||
+                        relays_related(relays->flags[r], relays->flags[ranks[1]])) {
+                    continue;
+                }
+                if(ranks[2] == -1 || r < ranks[2]) {
+                    ranks[2] = r;
+                }
+                break;
+            }
+        }
+        if(ranks[2] == -1) {
+            break;
+        }
+
+        /* ranks are in ranking order so the exit placement matches the ranking */
+        gint sorted[3] = {ranks[0], MIN(ranks[1], ranks[2]), MAX(ranks[1], ranks[2])};
+        g_queue_push_tail(circuits, prune_circuit_new(relays, sorted));
+        for(gint i = 0; i < 3; i++) {
+            used[ranks[i]] = TRUE;
+        }
+        nremaining -= 3;
+    }
+
+    for(gint c = 0; c < 4; c++) {
+        g_free(class_ranks[c]);
+    }
+    g_free(used);
+
+    return circuits;
+}
+
+/* for every relay the count highest bandwidth circuits through it, circuits
+ * shared by several relays listed once.  Pairs of other relays are walked by
+ * their lower ranked relay, so circuit bandwidth only falls along the walk */
+static GQueue *prune_top_k(prune_relays_t *relays, GHashTable *relay_table, GHashTable *relay_flags,
+        gint count, guint64 seed) {
+    gint n = relays->nrelays;
+    GHashTable *seen = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    GQueue *circuits = g_queue_new();
+
+    gint *class_ranks[4];
+    gint nclass[4] = {0, 0, 0, 0};
+    for(gint c = 0; c < 4; c++) {
+        class_ranks[c] = g_new(gint, n);
+    }
+    for(gint r = 0; r < n; r++) {
+        gint c = relays->flags[r] & RELAY_ROLES;
+        class_ranks[c][nclass[c]++] = r;
+    }
+
+    for(gint r = 0; r < n; r++) {
+        guint roles = relays->flags[r] & RELAY_ROLES;
+        gint found = 0;
+        for(gint b = 1; b < n && found < count; b++) {
+            if(b == r || relays_related(relays->flags[r], relays->flags[b])) {
+                continue;
+            }
+
+            /* only relays of a class that completes r and b are walked, best
+             * first, so a relay that completes few circuits costs little more
+             * than one pass over b */
+            gboolean valid[4];
+            gint cursor[4] = {0, 0, 0, 0};
+            for(gint c = 0; c < 4; c++) {
+                valid[c] = catalog_roles_valid(roles, relays->flags[b] & RELAY_ROLES, c);
+            }
+
+            while(found < count) {
+                gint a = -1;
+                gint a_class = -1;
+                for(gint c = 0; c < 4; c++) {
+                    if(valid[c] && cursor[c] < nclass[c] && class_ranks[c][cursor[c]] < b &&
+                            (a == -1 || class_ranks[c][cursor[c]] < a)) {
+                        a = class_ranks[c][cursor[c]];
+                        a_class = c;
+                    }
+                }
+                if(a == -1) {
+                    break;
+                }
+                cursor[a_class]++;
+                if(a == r) {
+                    continue;
+                }
+
+                gint ranks[3] = {MIN(r, a), 0, MAX(r, b)};
+                ranks[1] = r + a + b - ranks[0] - ranks[2];
+
+                circuit_t *circuit = prune_circuit_new(relays, ranks);
+                if(!circuit) {
+                    continue;
+                }
+                found++;
+
+                gint64 key = ((gint64)ranks[0] * n + ranks[1]) * n + ranks[2];
+                if(g_hash_table_contains(seen, &key)) {
+                    g_free(circuit);
+                    continue;
+                }
+                gint64 *seen_key = g_new(gint64, 1);
+                *seen_key = key;
+                g_hash_table_insert(seen, seen_key, seen_key);
+                g_queue_push_tail(circuits, circuit);
+            }
+        }
+    }
+
+    for(gint c = 0; c < 4; c++) {
+        g_free(class_ranks[c]);
+    }
+    g_hash_table_destroy(seen);
+
+    return circuits;
+}
+
+/* count distinct circuits drawn from the full catalog with probability
+ * proportional to their bandwidth, the catalog never drawing circuits within
+ * one family */
+static GQueue *prune_sampled(prune_relays_t *relays, GHashTable *relay_table, GHashTable *relay_flags,
+        gint count, guint64 seed) {
+    circuit_catalog_t *catalog = circuit_catalog_new(relay_table, relay_flags);
+    GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GQueue *circuits = g_queue_new();
+
+    rng_t rng;
+    rng_seed(&rng, seed);
+
+    gint ndraws = MIN(count, catalog->ncircuits);
+    for(gint attempts = 0; g_queue_get_length(circuits) < (guint)ndraws && attempts < 10 * ndraws; attempts++) {
+        gint idx = circuit_catalog_draw(catalog, &rng);
+        if(g_hash_table_contains(seen, GINT_TO_POINTER(idx + 1))) {
+            continue;
+        }
+        g_hash_table_insert(seen, GINT_TO_POINTER(idx + 1), GINT_TO_POINTER(idx + 1));
+
+        gint triple[3];
+        gint placed[3];
+        catalog_unrank_triple(catalog, idx, triple);
+        catalog_place(catalog, triple[0], triple[1], triple[2], placed);
+
+        gint bandwidth = G_MAXINT;
+        for(gint i = 0; i < 3; i++) {
+            bandwidth = MIN(bandwidth, catalog->relay_bandwidth[placed[i]]);
+        }
+
+        circuit_t *circuit = g_new0(circuit_t, 1);
+        circuit->bandwidth = bandwidth;
+        circuit->guard = catalog->relay_names[placed[0]];
+        circuit->middle = catalog->relay_names[placed[1]];
+        circuit->exit = catalog->relay_names[placed[2]];
+        g_queue_push_tail(circuits, circuit);
+    }
+
+    if(g_queue_get_length(circuits) < (guint)count) {
+        g_warning("sampled only %u of %d pruned circuits", g_queue_get_length(circuits), count);
+    }
+
+    g_hash_table_destroy(seen);
+    circuit_catalog_free(catalog);
+
+    return circuits;
+}
+
+static const struct {
+    const gchar *name;
+    prune_func func;
+} prune_strategies[] = {
+    { "greedy", prune_greedy },
+    { "top-k", prune_top_k },
+    { "sampled", prune_sampled },
+};
+
+/* count is the circuits per relay for top-k and the circuits drawn for sampled */
+GQueue *build_pruned_circuits(GHashTable *relays, GHashTable *relay_flags, const gchar *strategy,
+        gint count, guint64 seed) {
+    g_assert(relays);
+    g_assert(relay_flags);
+
+    for(guint i = 0; i < G_N_ELEMENTS(prune_strategies); i++) {
+        if(!g_ascii_strcasecmp(strategy, prune_strategies[i].name)) {
+            prune_relays_t *ranked = prune_relays_new(relays, relay_flags);
+            GQueue *circuits = prune_strategies[i].func(ranked, relays, relay_flags, count, seed);
+            prune_relays_free(ranked);
+            return circuits;
+        }
+    }
+
+    g_error("unknown pruning strategy '%s'", strategy);
+    return NULL;
+}
+
+circuit_sampler_t *circuit_sampler_new(circuit_t **circuit_list, gint ncircuits) {
+    circuit_sampler_t *sampler = g_new0(circuit_sampler_t, 1);
+    sampler->ncircuits = ncircuits;
+    sampler->cumulative_weight = g_new(gint64, ncircuits);
+
+    gint64 total_weight = 0;
+    for(gint idx = 0; idx < ncircuits; idx++) {
+        total_weight += MAX((gint)(circuit_list[idx]->bandwidth / 1024.0), 1);
+        sampler->cumulative_weight[idx] = total_weight;
+    }
+
+    /*g_message("total circuit bandwidth %ld", total_weight);*/
+    return sampler;
+}
+
+void generate_circuit_lists(GQueue *circuits, circuit_t ***circuit_list, circuit_sampler_t **circuit_sampler) {
+    g_assert(circuits);
+
+    gint ncircuits = g_queue_get_length(circuits);
+    *circuit_list = (circuit_t **)g_new0(gpointer, ncircuits);
+    circuit_t **list = *circuit_list;
+
+    gint idx = 0;
+    for(GList *iter = g_queue_peek_head_link(circuits); iter; iter = g_list_next(iter)) {
+        list[idx++] = iter->data;
+    }
+
+    *circuit_sampler = circuit_sampler_new(list, ncircuits);
+}
+
+/* index of a circuit drawn with probability proportional to its weight */
+gint circuit_sampler_draw(circuit_sampler_t *sampler, rng_t *rng) {
+    g_assert(sampler);
+    g_assert(sampler->ncircuits > 0);
+
+    if(sampler->catalog) {
+        return circuit_catalog_draw(sampler->catalog, rng);
+    }
+
+    gint64 r = rng_int(rng, sampler->cumulative_weight[sampler->ncircuits - 1]);
+
+    /* first circuit whose running total is past r */
+    gint low = 0;
+    gint high = sampler->ncircuits - 1;
+    while(low < high) {
+        gint mid = low + (high - low) / 2;
+        if(sampler->cumulative_weight[mid] > r) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Interning of relays, circuits and downloads to dense integer ids
+ */
+
+static gint intern_relay(network_t *network, gchar *relay, gint bandwidth) {
+    gint id = GPOINTER_TO_INT(g_hash_table_lookup(network->relay_ids, relay)) - 1;
+    if(id >= 0) {
+        return id;
+    }
+
+    id = network->nrelays++;
+    network->relay_names = g_renew(gchar *, network->relay_names, network->nrelays);
+    network->relay_bandwidth = g_renew(gint, network->relay_bandwidth, network->nrelays);
+    network->relay_names[id] = relay;
+    network->relay_bandwidth[id] = bandwidth;
+    g_hash_table_insert(network->relay_ids, relay, GINT_TO_POINTER(id + 1));
+
+    return id;
+}
+
+/* downloads sharing a circuit list share its columns */
+static void network_bind_columns(network_t *network) {
+    network->circuit_columns = g_queue_new();
+    GHashTable *columns_by_list = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    for(gint idx = 0; idx < network->ndownloads; idx++) {
+        download_t *download = network->downloads[idx];
+        if(!download->circuit_list) {
+            continue;
+        }
+
+        circuit_columns_t *columns = g_hash_table_lookup(columns_by_list, download->circuit_list);
+        if(!columns) {
+            columns = g_new0(circuit_columns_t, 1);
+            columns->ncircuits = download->ncircuits;
+            for(gint i = 0; i < 3; i++) {
+                columns->relays[i] = g_new(gint, columns->ncircuits);
+                for(gint j = 0; j < columns->ncircuits; j++) {
+                    columns->relays[i][j] = download->circuit_list[j]->relays[i];
+                }
+            }
+            g_hash_table_insert(columns_by_list, download->circuit_list, columns);
+            g_queue_push_tail(network->circuit_columns, columns);
+        }
+        download->circuit_columns = columns;
+    }
+    g_hash_table_destroy(columns_by_list);
+}
+
+/* circuits are the materialized global list, or NULL when every download
+ * draws from the catalog */
+network_t *network_new(GHashTable *relays, GQueue *circuits, circuit_catalog_t *catalog, GQueue *downloads) {
+    g_assert(relays);
+    g_assert(circuits || catalog);
+    g_assert(downloads);
+
+    network_t *network = g_new0(network_t, 1);
+    network->relay_ids = g_hash_table_new(g_str_hash, g_str_equal);
+
+    GHashTableIter iter;
+    gpointer key,value;
+
+    g_hash_table_iter_init(&iter, relays);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        intern_relay(network, (gchar *)key, GPOINTER_TO_INT(value));
+    }
+
+    if(catalog) {
+        for(gint p = 0; p < catalog->nrelays; p++) {
+            catalog->relays[p] = GPOINTER_TO_INT(g_hash_table_lookup(network->relay_ids, catalog->relay_names[p])) - 1;
+        }
+        network->catalog = catalog;
+        network->ncircuits = catalog->ncircuits;
+    } else {
+        network->ncircuits = g_queue_get_length(circuits);
+        network->circuits = (circuit_t **)g_new0(gpointer, network->ncircuits);
+    }
+
+    gint idx = 0;
+    for(GList *iter = circuits ? g_queue_peek_head_link(circuits) : NULL; iter; iter = g_list_next(iter)) {
+        circuit_t *circuit = iter->data;
+        gchar *path[3] = {circuit->guard, circuit->middle, circuit->exit};
+
+        for(gint i = 0; i < 3; i++) {
+            if(!g_hash_table_lookup(network->relay_ids, path[i])) {
+                g_warning("circuit relay %s not in relay list, using 0 bandwidth", path[i]);
+            }
+            circuit->relays[i] = intern_relay(network, path[i], 0);
+        }
+
+        circuit->id = idx;
+        network->circuits[idx++] = circuit;
+    }
+
+    network->ndownloads = g_queue_get_length(downloads);
+    network->downloads = (download_t **)g_new0(gpointer, network->ndownloads);
+
+    idx = 0;
+    for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
+        download_t *download = iter->data;
+        download->id = idx;
+        network->downloads[idx++] = download;
+        if(!download->circuit_list) {
+            download->ncircuits = catalog->ncircuits;
+        }
+    }
+
+    network_bind_columns(network);
+
+    return network;
+}
+
+/* guard, middle and exit relay ids of a circuit */
+static inline void network_circuit_path(network_t *network, gint circuit, gint *path) {
+    if(network->circuits) {
+        memcpy(path, network->circuits[circuit]->relays, 3 * sizeof(gint));
+    } else {
+        circuit_catalog_unrank(network->catalog, circuit, path);
+    }
+}
+
+/* global id of a download's idx-th candidate, catalog downloads take them all */
+static inline gint download_circuit(download_t *download, gint idx) {
+    return download->circuit_list ? download->circuit_list[idx]->id : idx;
+}
+
+static void circuit_columns_free(circuit_columns_t *columns) {
+    for(gint i = 0; i < 3; i++) {
+        g_free(columns->relays[i]);
+    }
+    g_free(columns);
+}
+
+void network_free(network_t *network) {
+    g_queue_free_full(network->circuit_columns, (GDestroyNotify)circuit_columns_free);
+    if(network->catalog) {
+        circuit_catalog_free(network->catalog);
+    }
+    g_hash_table_destroy(network->relay_ids);
+    g_free(network->relay_names);
+    g_free(network->relay_bandwidth);
+    g_free(network->circuits);
+    g_free(network->downloads);
+    g_free(network);
+}
+
+/*
+ * Compiled scenarios
+ *
+ * A scenario is the network built from the input files written out as flat
+ * arrays in network id order, so a later run maps the file and binds the
+ * network to it without parsing or building circuits again.  Names, circuit
+ * lists and their sampling weights are used from the mapping in place.
+ */
+
+#define SCENARIO_MAGIC "TOSSCEN"
+#define SCENARIO_VERSION 1
+#define SCENARIO_BYTE_ORDER 0x01020304u
+#define SCENARIO_ALIGN 8
+
+enum {
+    SCENARIO_STRINGS,
+    SCENARIO_RELAY_NAMES,
+    SCENARIO_RELAY_BANDWIDTH,
+    SCENARIO_RELAY_FLAGS,
+    SCENARIO_CATALOG_ORDER,
+    SCENARIO_CIRCUIT_RELAYS,
+    SCENARIO_CIRCUIT_BANDWIDTH,
+    SCENARIO_LIST_START,
+    SCENARIO_CANDIDATES,
+    SCENARIO_WEIGHTS,
+    SCENARIO_DOWNLOAD_CLIENT,
+    SCENARIO_DOWNLOAD_START,
+    SCENARIO_DOWNLOAD_END,
+    SCENARIO_DOWNLOAD_LIST,
+    SCENARIO_NSECTIONS
+};
+
+/* list 0 is the global circuit list unless every download uses the catalog,
+ * a download's list is -1 for the catalog.  Candidates are circuit ids, each
+ * list's span of weights running totals restarting at the list */
+typedef struct scenario_header_s {
+    gchar magic[8];
+    guint32 version;
+    guint32 byte_order;
+    gint32 nrelays;
+    gint32 ncircuits;
+    gint32 ndownloads;
+    gint32 nlists;
+    gint32 ncandidates;
+    gint32 catalog;
+    guint64 size;
+    guint64 offset[SCENARIO_NSECTIONS];
+    guint64 length[SCENARIO_NSECTIONS];
+} scenario_header_t;
+
+/* a loaded scenario, owning the mapping and everything bound to it */
+typedef struct scenario_s {
+    GMappedFile *mapped;
+    network_t *network;
+    GQueue *downloads;
+    circuit_t *circuits;
+    download_t *download_slab;
+    circuit_t ***lists;
+    circuit_sampler_t *samplers;
+    gint nlists;
+    circuit_sampler_t *catalog_sampler;
+} scenario_t;
+
+static void scenario_section(GByteArray *buffer, scenario_header_t *header, gint section,
+        gconstpointer data, gsize length) {
+    static const guint8 padding[SCENARIO_ALIGN] = {0};
+    g_byte_array_append(buffer, padding, (SCENARIO_ALIGN - buffer->len % SCENARIO_ALIGN) % SCENARIO_ALIGN);
+    header->offset[section] = buffer->len;
+    header->length[section] = length;
+    g_byte_array_append(buffer, data, length);
+}
+
+static guint32 scenario_string(GByteArray *strings, GHashTable *offsets, const gchar *string) {
+    gpointer offset;
+    if(g_hash_table_lookup_extended(offsets, string, NULL, &offset)) {
+        return GPOINTER_TO_UINT(offset);
+    }
+
+    guint32 start = strings->len;
+    g_byte_array_append(strings, (const guint8 *)string, strlen(string) + 1);
+    g_hash_table_insert(offsets, (gpointer)string, GUINT_TO_POINTER(start));
+    return start;
+}
+
+gboolean scenario_write(const gchar *filename, network_t *network, GHashTable *relay_flags) {
+    g_assert(network);
+
+    scenario_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENARIO_MAGIC, sizeof(header.magic));
+    header.version = SCENARIO_VERSION;
+    header.byte_order = SCENARIO_BYTE_ORDER;
+    header.nrelays = network->nrelays;
+    header.ncircuits = network->circuits ? network->ncircuits : 0;
+    header.ndownloads = network->ndownloads;
+    header.catalog = network->catalog != NULL;
+
+    GByteArray *strings = g_byte_array_new();
+    GHashTable *string_offsets = g_hash_table_new(g_str_hash, g_str_equal);
+
+    gint n = network->nrelays;
+    guint32 *relay_names = g_new(guint32, n);
+    guint32 *flags = g_new(guint32, n);
+    for(gint r = 0; r < n; r++) {
+        relay_names[r] = scenario_string(strings, string_offsets, network->relay_names[r]);
+        flags[r] = GPOINTER_TO_UINT(g_hash_table_lookup(relay_flags, network->relay_names[r]));
+    }
+
+    gint32 *circuit_relays = g_new(gint32, 3 * (gsize)header.ncircuits);
+    gdouble *circuit_bandwidth = g_new(gdouble, header.ncircuits);
+    for(gint c = 0; c < header.ncircuits; c++) {
+        memcpy(&circuit_relays[3 * c], network->circuits[c]->relays, 3 * sizeof(gint32));
+        circuit_bandwidth[c] = network->circuits[c]->bandwidth;
+    }
+
+    /* circuit lists in order of first use, downloads sharing a list share it */
+    GHashTable *list_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GArray *list_start = g_array_new(FALSE, FALSE, sizeof(gint32));
+    GArray *candidates = g_array_new(FALSE, FALSE, sizeof(gint32));
+    GArray *weights = g_array_new(FALSE, FALSE, sizeof(gint64));
+    guint32 *download_client = g_new(guint32, network->ndownloads);
+    gint32 *download_start = g_new(gint32, network->ndownloads);
+    gint32 *download_end = g_new(gint32, network->ndownloads);
+    gint32 *download_list = g_new(gint32, network->ndownloads);
+
+    for(gint i = 0; i < network->ndownloads; i++) {
+        download_t *download = network->downloads[i];
+        download_client[i] = scenario_string(strings, string_offsets, download->client);
+        download_start[i] = download->start_time;
+        download_end[i] = download->end_time;
+
+        if(!download->circuit_list) {
+            download_list[i] = -1;
+            continue;
+        }
+
+        gpointer list;
+        if(!g_hash_table_lookup_extended(list_ids, download->circuit_list, NULL, &list)) {
+            list = GINT_TO_POINTER(list_start->len);
+            g_hash_table_insert(list_ids, download->circuit_list, list);
+
+            gint32 start = candidates->len;
+            g_array_append_val(list_start, start);
+            for(gint j = 0; j < download->ncircuits; j++) {
+                gint32 circuit = download->circuit_list[j]->id;
+                g_array_append_val(candidates, circuit);
+                g_array_append_val(weights, download->circuit_sampler->cumulative_weight[j]);
+            }
+        }
+        download_list[i] = GPOINTER_TO_INT(list);
+    }
+    header.nlists = list_start->len;
+    header.ncandidates = candidates->len;
+    gint32 end = candidates->len;
+    g_array_append_val(list_start, end);
+
+    GByteArray *buffer = g_byte_array_new();
+    g_byte_array_append(buffer, (const guint8 *)&header, sizeof(header));
+    scenario_section(buffer, &header, SCENARIO_STRINGS, strings->data, strings->len);
+    scenario_section(buffer, &header, SCENARIO_RELAY_NAMES, relay_names, n * sizeof(guint32));
+    scenario_section(buffer, &header, SCENARIO_RELAY_BANDWIDTH, network->relay_bandwidth, n * sizeof(gint32));
+    scenario_section(buffer, &header, SCENARIO_RELAY_FLAGS, flags, n * sizeof(guint32));
+    scenario_section(buffer, &header, SCENARIO_CATALOG_ORDER, network->catalog ? network->catalog->relays : NULL,
+            network->catalog ? n * sizeof(gint32) : 0);
+    scenario_section(buffer, &header, SCENARIO_CIRCUIT_RELAYS, circuit_relays, 3 * (gsize)header.ncircuits * sizeof(gint32));
+    scenario_section(buffer, &header, SCENARIO_CIRCUIT_BANDWIDTH, circuit_bandwidth, header.ncircuits * sizeof(gdouble));
+    scenario_section(buffer, &header, SCENARIO_LIST_START, list_start->data, list_start->len * sizeof(gint32));
+    scenario_section(buffer, &header, SCENARIO_CANDIDATES, candidates->data, candidates->len * sizeof(gint32));
+    scenario_section(buffer, &header, SCENARIO_WEIGHTS, weights->data, weights->len * sizeof(gint64));
+    scenario_section(buffer, &header, SCENARIO_DOWNLOAD_CLIENT, download_client, network->ndownloads * sizeof(guint32));
+    scenario_section(buffer, &header, SCENARIO_DOWNLOAD_START, download_start, network->ndownloads * sizeof(gint32));
+    scenario_section(buffer, &header, SCENARIO_DOWNLOAD_END, download_end, network->ndownloads * sizeof(gint32));
+    scenario_section(buffer, &header, SCENARIO_DOWNLOAD_LIST, download_list, network->ndownloads * sizeof(gint32));
+    header.size = buffer->len;
+    memcpy(buffer->data, &header, sizeof(header));
+
+    GError *error = NULL;
+    gboolean success = g_file_set_contents(filename, (const gchar *)buffer->data, buffer->len, &error);
+    if(!success) {
+        g_warning("g_file_set_contents: %s", error->message);
+        g_error_free(error);
+    }
+
+    g_byte_array_free(buffer, TRUE);
+    g_byte_array_free(strings, TRUE);
+    g_hash_table_destroy(string_offsets);
+    g_hash_table_destroy(list_ids);
+    g_array_free(list_start, TRUE);
+    g_array_free(candidates, TRUE);
+    g_array_free(weights, TRUE);
+    g_free(relay_names);
+    g_free(flags);
+    g_free(circuit_relays);
+    g_free(circuit_bandwidth);
+    g_free(download_client);
+    g_free(download_start);
+    g_free(download_end);
+    g_free(download_list);
+
+    return success;
+}
+
+/* section of a mapped scenario if it holds count elements of the given size */
+static gconstpointer scenario_array(const gchar *base, scenario_header_t *header, gint section,
+        gsize count, gsize size) {
+    if(header->offset[section] % SCENARIO_ALIGN || header->length[section] != count * size ||
+            header->offset[section] > header->size || header->length[section] > header->size - header->offset[section]) {
+        return NULL;
+    }
+    return base + header->offset[section];
+}
+
+/* NULL if the file is not a scenario this version can read */
+scenario_t *scenario_load(const gchar *filename) {
+    GError *error = NULL;
+    GMappedFile *mapped = g_mapped_file_new(filename, FALSE, &error);
+    if(!mapped) {
+        g_warning("g_mapped_file_new: %s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    const gchar *base = g_mapped_file_get_contents(mapped);
+    gsize size = g_mapped_file_get_length(mapped);
+    scenario_header_t header;
+    if(size < sizeof(header)) {
+        g_warning("%s is not a compiled scenario", filename);
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+    memcpy(&header, base, sizeof(header));
+    if(memcmp(header.magic, SCENARIO_MAGIC, sizeof(header.magic)) || header.byte_order != SCENARIO_BYTE_ORDER ||
+            header.size != size) {
+        g_warning("%s is not a compiled scenario", filename);
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+    if(header.version != SCENARIO_VERSION) {
+        g_warning("%s is a version %u scenario, expected version %d", filename, header.version, SCENARIO_VERSION);
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+
+    gint n = header.nrelays;
+    const gchar *strings = scenario_array(base, &header, SCENARIO_STRINGS, header.length[SCENARIO_STRINGS], 1);
+    const guint32 *relay_names = scenario_array(base, &header, SCENARIO_RELAY_NAMES, n, sizeof(guint32));
+    const gint32 *relay_bandwidth = scenario_array(base, &header, SCENARIO_RELAY_BANDWIDTH, n, sizeof(gint32));
+    const guint32 *relay_flags = scenario_array(base, &header, SCENARIO_RELAY_FLAGS, n, sizeof(guint32));
+    const gint32 *catalog_order = scenario_array(base, &header, SCENARIO_CATALOG_ORDER,
+            header.catalog ? n : 0, sizeof(gint32));
+    const gint32 *circuit_relays = scenario_array(base, &header, SCENARIO_CIRCUIT_RELAYS,
+            3 * (gsize)header.ncircuits, sizeof(gint32));
+    const gdouble *circuit_bandwidth = scenario_array(base, &header, SCENARIO_CIRCUIT_BANDWIDTH,
+            header.ncircuits, sizeof(gdouble));
+    const gint32 *list_start = scenario_array(base, &header, SCENARIO_LIST_START, header.nlists + 1, sizeof(gint32));
+    const gint32 *candidates = scenario_array(base, &header, SCENARIO_CANDIDATES, header.ncandidates, sizeof(gint32));
+    const gint64 *weights = scenario_array(base, &header, SCENARIO_WEIGHTS, header.ncandidates, sizeof(gint64));
+    const guint32 *download_client = scenario_array(base, &header, SCENARIO_DOWNLOAD_CLIENT,
+            header.ndownloads, sizeof(guint32));
+    const gint32 *download_start = scenario_array(base, &header, SCENARIO_DOWNLOAD_START,
+            header.ndownloads, sizeof(gint32));
+    const gint32 *download_end = scenario_array(base, &header, SCENARIO_DOWNLOAD_END, header.ndownloads, sizeof(gint32));
+    const gint32 *download_list = scenario_array(base, &header, SCENARIO_DOWNLOAD_LIST,
+            header.ndownloads, sizeof(gint32));
+    if(!strings || !relay_names || !relay_bandwidth || !relay_flags || !catalog_order || !circuit_relays ||
+            !circuit_bandwidth || !list_start || !candidates || !weights || !download_client ||
+            !download_start || !download_end || !download_list) {
+        g_warning("%s is a corrupt scenario", filename);
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+
+    /* every id and string offset in range, the catalog order a permutation
+     * and every list a non-empty run of strictly increasing positive weights,
+     * so binding and drawing need no checks */
+    guint64 nstrings = header.length[SCENARIO_STRINGS];
+    gboolean valid = (!nstrings || strings[nstrings - 1] == '\0') && list_start[0] == 0 &&
+        list_start[header.nlists] == header.ncandidates;
+    guint8 *placed = header.catalog ? g_new0(guint8, n) : NULL;
+    for(gint r = 0; valid && r < n; r++) {
+        valid = relay_names[r] < nstrings;
+        if(valid && header.catalog) {
+            valid = catalog_order[r] >= 0 && catalog_order[r] < n && !placed[catalog_order[r]];
+            if(valid) {
+                placed[catalog_order[r]] = 1;
+            }
+        }
+    }
+    g_free(placed);
+    for(gint c = 0; valid && c < 3 * header.ncircuits; c++) {
+        valid = circuit_relays[c] >= 0 && circuit_relays[c] < n;
+    }
+    for(gint l = 0; valid && l < header.nlists; l++) {
+        valid = list_start[l] < list_start[l + 1] && list_start[l + 1] <= header.ncandidates;
+        for(gint j = list_start[l]; valid && j < list_start[l + 1]; j++) {
+            valid = weights[j] > (j > list_start[l] ? weights[j - 1] : 0);
+        }
+    }
+    for(gint j = 0; valid && j < header.ncandidates; j++) {
+        valid = candidates[j] >= 0 && candidates[j] < header.ncircuits;
+    }
+    for(gint i = 0; valid && i < header.ndownloads; i++) {
+        valid = download_client[i] < nstrings && download_list[i] < header.nlists &&
+            (download_list[i] >= 0 || header.catalog);
+    }
+    if(!valid) {
+        g_warning("%s is a corrupt scenario", filename);
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+
+    scenario_t *scenario = g_new0(scenario_t, 1);
+    scenario->mapped = mapped;
+
+    network_t *network = g_new0(network_t, 1);
+    scenario->network = network;
+    network->nrelays = n;
+    network->relay_names = g_new(gchar *, n);
+    network->relay_bandwidth = g_new(gint, n);
+    network->relay_ids = g_hash_table_new(g_str_hash, g_str_equal);
+    for(gint r = 0; r < n; r++) {
+        network->relay_names[r] = (gchar *)strings + relay_names[r];
+        network->relay_bandwidth[r] = relay_bandwidth[r];
+        g_hash_table_insert(network->relay_ids, network->relay_names[r], GINT_TO_POINTER(r + 1));
+    }
+
+    if(header.catalog) {
+        gchar **names = g_new(gchar *, n);
+        gint *bandwidth = g_new(gint, n);
+        guint *flags = g_new(guint, n);
+        for(gint p = 0; p < n; p++) {
+            names[p] = network->relay_names[catalog_order[p]];
+            bandwidth[p] = relay_bandwidth[catalog_order[p]];
+            flags[p] = relay_flags[catalog_order[p]];
+        }
+        circuit_catalog_t *catalog = circuit_catalog_new_ordered(n, names, bandwidth, flags);
+        memcpy(catalog->relays, catalog_order, n * sizeof(gint));
+        g_free(names);
+        g_free(bandwidth);
+        g_free(flags);
+
+        network->catalog = catalog;
+        network->ncircuits = catalog->ncircuits;
+        scenario->catalog_sampler = g_new0(circuit_sampler_t, 1);
+        scenario->catalog_sampler->ncircuits = catalog->ncircuits;
+        scenario->catalog_sampler->catalog = catalog;
+    } else {
+        network->ncircuits = header.ncircuits;
+        network->circuits = (circuit_t **)g_new0(gpointer, header.ncircuits);
+        scenario->circuits = g_new0(circuit_t, header.ncircuits);
+        for(gint c = 0; c < header.ncircuits; c++) {
+            circuit_t *circuit = &scenario->circuits[c];
+            memcpy(circuit->relays, &circuit_relays[3 * c], 3 * sizeof(gint));
+            circuit->guard = network->relay_names[circuit->relays[0]];
+            circuit->middle = network->relay_names[circuit->relays[1]];
+            circuit->exit = network->relay_names[circuit->relays[2]];
+            circuit->bandwidth = circuit_bandwidth[c];
+            circuit->id = c;
+            network->circuits[c] = circuit;
+        }
+    }
+
+    scenario->nlists = header.nlists;
+    scenario->lists = g_new(circuit_t **, header.nlists);
+    scenario->samplers = g_new0(circuit_sampler_t, header.nlists);
+    for(gint l = 0; l < header.nlists; l++) {
+        gint start = list_start[l];
+        gint ncandidates = list_start[l + 1] - start;
+        scenario->lists[l] = (circuit_t **)g_new(gpointer, ncandidates);
+        for(gint j = 0; j < ncandidates; j++) {
+            scenario->lists[l][j] = network->circuits[candidates[start + j]];
+        }
+        scenario->samplers[l].ncircuits = ncandidates;
+        scenario->samplers[l].cumulative_weight = (gint64 *)&weights[start];
+    }
+
+    network->ndownloads = header.ndownloads;
+    network->downloads = (download_t **)g_new0(gpointer, header.ndownloads);
+    scenario->download_slab = g_new0(download_t, header.ndownloads);
+    scenario->downloads = g_queue_new();
+    for(gint i = 0; i < header.ndownloads; i++) {
+        download_t *download = &scenario->download_slab[i];
+        download->client = (gchar *)strings + download_client[i];
+        download->start_time = download_start[i];
+        download->end_time = download_end[i];
+        download->id = i;
+
+        gint list = download_list[i];
+        if(list < 0) {
+            download->ncircuits = network->ncircuits;
+            download->circuit_sampler = scenario->catalog_sampler;
+        } else {
+            download->ncircuits = scenario->samplers[list].ncircuits;
+            download->circuit_list = scenario->lists[list];
+            download->circuit_sampler = &scenario->samplers[list];
+        }
+
+        network->downloads[i] = download;
+        g_queue_push_tail(scenario->downloads, download);
+    }
+
+    network_bind_columns(network);
+
+    return scenario;
+}
+
+/* frees the network along with the scenario */
+void scenario_free(scenario_t *scenario) {
+    network_free(scenario->network);
+    g_queue_free(scenario->downloads);
+    for(gint l = 0; l < scenario->nlists; l++) {
+        g_free(scenario->lists[l]);
+    }
+    g_free(scenario->lists);
+    g_free(scenario->samplers);
+    g_free(scenario->catalog_sampler);
+    g_free(scenario->circuits);
+    g_free(scenario->download_slab);
+    g_mapped_file_unref(scenario->mapped);
+    g_free(scenario);
+}
+
+gint *circuit_selection_new(network_t *network) {
+    gint *circuit_selection = g_new(gint, network->ndownloads);
+    for(gint i = 0; i < network->ndownloads; i++) {
+        circuit_selection[i] = -1;
+    }
+    return circuit_selection;
+}
+
+active_set_t *active_set_new(gint size) {
+    active_set_t *active_set = g_new0(active_set_t, 1);
+    active_set->downloads = g_new(gint, size);
+    active_set->position = g_new(gint, size);
+    for(gint i = 0; i < size; i++) {
+        active_set->position[i] = -1;
+    }
+    return active_set;
+}
+
+void active_set_free(active_set_t *active_set) {
+    g_free(active_set->downloads);
+    g_free(active_set->position);
+    g_free(active_set);
+}
+
+void active_set_add(active_set_t *active_set, gint download) {
+    if(active_set->position[download] != -1) {
+        return;
+    }
+    active_set->position[download] = active_set->ndownloads;
+    active_set->downloads[active_set->ndownloads++] = download;
+}
+
+void active_set_remove(active_set_t *active_set, gint download) {
+    gint idx = active_set->position[download];
+    if(idx == -1) {
+        return;
+    }
+
+    /* move the last download into the freed slot */
+    gint last = active_set->downloads[--active_set->ndownloads];
+    active_set->downloads[idx] = last;
+    active_set->position[last] = idx;
+    active_set->position[download] = -1;
+}
+
+void write_circuits_to_file(GQueue *downloads, network_t *network, gint *circuit_selection, gchar *filename) {
+    GString *content = g_string_new("");
+    for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
+        download_t *download = iter->data;
+        gint path[3];
+        network_circuit_path(network, circuit_selection[download->id], path);
+        g_string_append_printf(content, "%s %f %f %s %s %s\n", download->client,
+                download->start_time / 1000.0, download->end_time / 1000.0,
+                network->relay_names[path[0]], network->relay_names[path[1]], network->relay_names[path[2]]);
+    }
+
+    GError *error = NULL;
+    if(!g_file_set_contents(filename, content->str, content->len, &error)) {
+        g_error("[ERROR] g_file_set_contents: %s", error->message);
+        g_error_free(error);
+    }
+
+    g_string_free(content, TRUE);
+}
+
+
+/*
+ * Work-stealing executor shared by all modes
+ *
+ * Every participating thread owns a deque of index ranges. A thread pops
+ * from the tail of its own deque, splitting ranges larger than the grain
+ * and pushing the upper half back, and steals from the head of the other
+ * deques when its own is empty. The thread calling executor_parallel_for
+ * takes part until its loop is done, so calls may be nested.
+ */
+
+typedef void (*executor_func_t)(gint start, gint end, gpointer user_data);
+
+typedef struct executor_job_s {
+    executor_func_t func;
+    gpointer user_data;
+    gint grain;
+    gint pending;
+} executor_job_t;
+
+typedef struct executor_task_s {
+    executor_job_t *job;
+    gint start;
+    gint end;
+} executor_task_t;
+
+typedef struct executor_worker_s {
+    executor_t *executor;
+    gint idx;
+    GMutex lock;
+    GQueue *tasks;
+    GThread *thread;
+} executor_worker_t;
+
+struct executor_s {
+    gint nworkers;
+    executor_worker_t *workers;
+    GMutex lock;
+    GCond wake;
+    gint nqueued;
+    gboolean shutdown;
+};
+
+static GPrivate executor_current_worker;
+
+static executor_worker_t *executor_self(executor_t *executor) {
+    executor_worker_t *worker = g_private_get(&executor_current_worker);
+    if(worker && worker->executor == executor) {
+        return worker;
+    }
+    /* threads the executor does not own share the first deque */
+    return &executor->workers[0];
+}
+
+static void executor_push(executor_worker_t *worker, executor_job_t *job, gint start, gint end) {
+    executor_t *executor = worker->executor;
+    executor_task_t *task = g_new(executor_task_t, 1);
+    task->job = job;
+    task->start = start;
+    task->end = end;
+
+    g_mutex_lock(&worker->lock);
+    g_queue_push_tail(worker->tasks, task);
+    g_mutex_unlock(&worker->lock);
+
+    g_mutex_lock(&executor->lock);
+    executor->nqueued++;
+    g_cond_signal(&executor->wake);
+    g_mutex_unlock(&executor->lock);
+}
+
+static executor_task_t *executor_pop(executor_worker_t *worker) {
+    executor_t *executor = worker->executor;
+    executor_task_t *task = NULL;
+
+    g_mutex_lock(&worker->lock);
+    task = g_queue_pop_tail(worker->tasks);
+    g_mutex_unlock(&worker->lock);
+
+    for(gint i = 1; !task && i < executor->nworkers; i++) {
+        executor_worker_t *victim = &executor->workers[(worker->idx + i) % executor->nworkers];
+        g_mutex_lock(&victim->lock);
+        task = g_queue_pop_head(victim->tasks);
+        g_mutex_unlock(&victim->lock);
+    }
+
+    if(task) {
+        g_mutex_lock(&executor->lock);
+        executor->nqueued--;
+        g_mutex_unlock(&executor->lock);
+    }
+    return task;
+}
+
+/* runs one queued task, returns FALSE if every deque was empty */
+static gboolean executor_run_one(executor_worker_t *worker) {
+    executor_task_t *task = executor_pop(worker);
+    if(!task) {
+        return FALSE;
+    }
+
+    executor_job_t *job = task->job;
+    gint start = task->start;
+    gint end = task->end;
+    g_free(task);
+
+    while(end - start > job->grain) {
+        gint mid = start + (end - start) / 2;
+        executor_push(worker, job, mid, end);
+        end = mid;
+    }
+
+    job->func(start, end, job->user_data);
+
+    if(g_atomic_int_add(&job->pending, -(end - start)) == end - start) {
+        executor_t *executor = worker->executor;
+        g_mutex_lock(&executor->lock);
+        g_cond_broadcast(&executor->wake);
+        g_mutex_unlock(&executor->lock);
+    }
+    return TRUE;
+}
+
+static gpointer executor_thread(gpointer data) {
+    executor_worker_t *worker = (executor_worker_t *)data;
+    executor_t *executor = worker->executor;
+    g_private_set(&executor_current_worker, worker);
+
+    while(TRUE) {
+        if(executor_run_one(worker)) {
+            continue;
+        }
+
+        g_mutex_lock(&executor->lock);
+        while(!executor->nqueued && !executor->shutdown) {
+            g_cond_wait(&executor->wake, &executor->lock);
+        }
+        gboolean shutdown = executor->shutdown;
+        g_mutex_unlock(&executor->lock);
+
+        if(shutdown) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* the calling thread counts as one of the nthreads workers */
+executor_t *executor_new(gint nthreads) {
+    executor_t *executor = g_new0(executor_t, 1);
+    executor->nworkers = MAX(nthreads, 1);
+    executor->workers = g_new0(executor_worker_t, executor->nworkers);
+    g_mutex_init(&executor->lock);
+    g_cond_init(&executor->wake);
+
+    for(gint i = 0; i < executor->nworkers; i++) {
+        executor_worker_t *worker = &executor->workers[i];
+        worker->executor = executor;
+        worker->idx = i;
+        worker->tasks = g_queue_new();
+        g_mutex_init(&worker->lock);
+    }
+
+    g_private_set(&executor_current_worker, &executor->workers[0]);
+    for(gint i = 1; i < executor->nworkers; i++) {
+        executor->workers[i].thread = g_thread_new("executor", executor_thread, &executor->workers[i]);
+    }
+
+    return executor;
+}
+
+void executor_free(executor_t *executor) {
+    g_mutex_lock(&executor->lock);
+    executor->shutdown = TRUE;
+    g_cond_broadcast(&executor->wake);
+    g_mutex_unlock(&executor->lock);
+
+    for(gint i = 1; i < executor->nworkers; i++) {
+        g_thread_join(executor->workers[i].thread);
+    }
+
+    /* idle threads keep polling every deque until they are joined */
+    for(gint i = 0; i < executor->nworkers; i++) {
+        executor_worker_t *worker = &executor->workers[i];
+        g_assert(g_queue_is_empty(worker->tasks));
+        g_queue_free(worker->tasks);
+        g_mutex_clear(&worker->lock);
+    }
+
+    g_mutex_clear(&executor->lock);
+    g_cond_clear(&executor->wake);
+    g_free(executor->workers);
+    g_free(executor);
+}
+
+/* calls func over [start, end) in ranges of at most grain items, returning
+ * once all of them are done */
+void executor_parallel_for(executor_t *executor, gint start, gint end, gint grain,
+        executor_func_t func, gpointer user_data) {
+    g_assert(executor);
+    g_assert(func);
+
+    if(end <= start) {
+        return;
+    }
+
+    executor_job_t job = { func, user_data, MAX(grain, 1), end - start };
+    executor_worker_t *worker = executor_self(executor);
+
+    if(executor->nworkers == 1) {
+        for(gint i = start; i < end; i += job.grain) {
+            func(i, MIN(i + job.grain, end), user_data);
+        }
+        return;
+    }
+
+    executor_push(worker, &job, start, end);
+
+    while(g_atomic_int_get(&job.pending) > 0) {
+        if(executor_run_one(worker)) {
+            continue;
+        }
+
+        g_mutex_lock(&executor->lock);
+        while(g_atomic_int_get(&job.pending) > 0 && !executor->nqueued) {
+            g_cond_wait(&executor->wake, &executor->lock);
+        }
+        g_mutex_unlock(&executor->lock);
+    }
+}
+
+/*
+ * Calculate bandwidth of each circuit
+ */
+
+/* per call state of the max-min fair solver, arrays are indexed by relay id
+ * except assigned and paths which are indexed by position in the active
+ * download set, paths holding the three relays of each download's circuit.
+ * heap is an indexed min-heap of the relays that can still be the bottleneck,
+ * ordered by per download bandwidth and then relay id. */
+typedef struct solver_state_s {
+    gdouble *bandwidth;
+    gboolean *active;
+    gint *ndownloads;
+    gint *offsets;
+    gint *ends;
+    gint *relay_downloads;
+    gboolean *assigned;
+    gint *paths;
+    gint *relays;
+    gint nrelays;
+    gint nactive_relays;
+    gint nloaded_relays;
+    gdouble *share;
+    gint *heap;
+    gint *heap_position;
+    gint nheap;
+} solver_state_t;
+
+void update_active_relay(solver_state_t *state, network_t *network, gdouble *capacity, gint relay) {
+    g_assert(state);
+    g_assert(relay >= 0 && relay < network->nrelays);
+
+    if(!state->ndownloads[relay]) {
+        state->bandwidth[relay] = capacity ? capacity[relay] : (gdouble)network->relay_bandwidth[relay];
+        state->active[relay] = TRUE;
+        state->relays[state->nrelays++] = relay;
+        state->nactive_relays++;
+        state->nloaded_relays++;
+    }
+    state->ndownloads[relay]++;
+}
+
+void update_relays(solver_state_t *state, gint relay, gdouble download_bandwidth) {
+    g_assert(state);
+
+    if(!state->active[relay]) {
+        return;
+    }
+
+    state->bandwidth[relay] -= download_bandwidth;
+    if(state->bandwidth[relay] < 0.000001) {
+        g_debug("removing relay %d from list with bandwidth %f", relay, state->bandwidth[relay]);
+        state->active[relay] = FALSE;
+        state->nactive_relays--;
+    }
+}
+
+void remove_download_from_relay(solver_state_t *state, gint relay) {
+    g_assert(state);
+
+    if(state->ndownloads[relay] <= 0) {
+        g_error("relay %d had no download list", relay);
+        return;
+    }
+
+    state->ndownloads[relay]--;
+    if(state->ndownloads[relay] == 0) {
+        g_debug("removing %d from downloads", relay);
+        state->nloaded_relays--;
+    }
+}
+
+/* progressive filling over the given downloads, relays start with capacity
+ * (or their full bandwidth if NULL) and each download's assigned bandwidth is
+ * stored in rates indexed by download id when rates is given */
+static gboolean relay_heap_less(solver_state_t *state, gint relay1, gint relay2) {
+    return state->share[relay1] < state->share[relay2] ||
+        (state->share[relay1] == state->share[relay2] && relay1 < relay2);
+}
+
+static void relay_heap_place(solver_state_t *state, gint idx, gint relay) {
+    state->heap[idx] = relay;
+    state->heap_position[relay] = idx;
+}
+
+static void relay_heap_sift(solver_state_t *state, gint idx) {
+    gint relay = state->heap[idx];
+
+    while(idx > 0 && relay_heap_less(state, relay, state->heap[(idx - 1) / 2])) {
+        relay_heap_place(state, idx, state->heap[(idx - 1) / 2]);
+        idx = (idx - 1) / 2;
+    }
+
+    while(2 * idx + 1 < state->nheap) {
+        gint child = 2 * idx + 1;
+        if(child + 1 < state->nheap && relay_heap_less(state, state->heap[child + 1], state->heap[child])) {
+            child++;
+        }
+        if(!relay_heap_less(state, state->heap[child], relay)) {
+            break;
+        }
+        relay_heap_place(state, idx, state->heap[child]);
+        idx = child;
+    }
+
+    relay_heap_place(state, idx, relay);
+}
+
+/* re-key a relay after its bandwidth or download count changed, dropping it
+ * from the heap once it is out of bandwidth or has no downloads left */
+void relay_heap_update(solver_state_t *state, gint relay) {
+    gint idx = state->heap_position[relay];
+
+    if(!state->active[relay] || !state->ndownloads[relay] || !state->bandwidth[relay]) {
+        if(idx != -1) {
+            gint last = state->heap[--state->nheap];
+            state->heap_position[relay] = -1;
+            if(idx < state->nheap) {
+                relay_heap_place(state, idx, last);
+                relay_heap_sift(state, idx);
+            }
+        }
+        return;
+    }
+
+    state->share[relay] = state->bandwidth[relay] / state->ndownloads[relay];
+    if(idx == -1) {
+        idx = state->nheap++;
+        relay_heap_place(state, idx, relay);
+    }
+    relay_heap_sift(state, idx);
+}
+
+/*
+ * Per-thread solver workspace
+ *
+ * Every solve carves its arrays out of a bump arena kept by the calling
+ * thread, emptied at the start of the next solve and only grown when a solve
+ * needs more than it holds, so solving allocates nothing in steady state.
+ */
+
+#define SOLVER_ARENA_ALIGN 16
+
+typedef struct solver_arena_s {
+    guint8 *base;
+    gsize size;
+    gsize used;
+} solver_arena_t;
+
+static void solver_arena_free(gpointer data) {
+    solver_arena_t *arena = (solver_arena_t *)data;
+    g_free(arena->base);
+    g_free(arena);
+}
+
+static GPrivate solver_arena_key = G_PRIVATE_INIT(solver_arena_free);
+
+/* bytes a solve over ndownloads downloads needs, eleven arrays per relay and
+ * fourteen entries per download at most */
+static gsize solver_arena_bytes(gint nrelays, gint ndownloads) {
+    return 11 * (sizeof(gdouble) * (gsize)nrelays + SOLVER_ARENA_ALIGN) +
+        14 * (sizeof(gint) * ((gsize)ndownloads + 1) + SOLVER_ARENA_ALIGN);
+}
+
+/* the calling thread's arena, emptied and holding at least size bytes */
+static solver_arena_t *solver_arena_reset(gsize size) {
+    solver_arena_t *arena = g_private_get(&solver_arena_key);
+    if(!arena) {
+        arena = g_new0(solver_arena_t, 1);
+        g_private_set(&solver_arena_key, arena);
+    }
+
+    if(arena->size < size) {
+        g_free(arena->base);
+        arena->size = MAX(size, 2 * arena->size);
+        arena->base = g_malloc(arena->size);
+    }
+    arena->used = 0;
+
+    return arena;
+}
+
+static gpointer solver_arena_alloc(solver_arena_t *arena, gsize size) {
+    gpointer block = arena->base + arena->used;
+    arena->used += (size + SOLVER_ARENA_ALIGN - 1) & ~(gsize)(SOLVER_ARENA_ALIGN - 1);
+    g_assert(arena->used <= arena->size);
+    return block;
+}
+
+#define solver_arena_new(arena, type, n) ((type *)solver_arena_alloc((arena), sizeof(type) * (gsize)(n)))
+
+/* progressive filling of one component, downloads sharing no relay with any
+ * download outside it.  state's relay arrays are shared by all components
+ * and its download counts are left zeroed for the next one; downloads is
+ * only read to store rates */
+static gdouble solve_component(solver_state_t *state, network_t *network, gint *downloads, gint ndownloads,
+        gint *paths, gdouble *capacity, gdouble *rates, gdouble *weights, gint *available_bandwidth) {
+    state->paths = paths;
+    state->nrelays = 0;
+    state->nactive_relays = 0;
+    state->nloaded_relays = 0;
+    state->nheap = 0;
+    memset(state->assigned, 0, ndownloads * sizeof(gboolean));
+
+    /* 1. Build mapping of relay and all active downloads */
+    for(gint i = 0; i < ndownloads; i++) {
+        gint *path = state->paths + 3 * i;
+
+        update_active_relay(state, network, capacity, path[0]);
+        update_active_relay(state, network, capacity, path[1]);
+        update_active_relay(state, network, capacity, path[2]);
+    }
+
+    gint offset = 0;
+    for(gint i = 0; i < state->nrelays; i++) {
+        gint relay = state->relays[i];
+        state->offsets[relay] = offset;
+        state->ends[relay] = offset;
+        offset += state->ndownloads[relay];
+
+        if(!state->bandwidth[relay]) {
+            g_warning("relay %s has 0 bandwidth, should not be in active list", network->relay_names[relay]);
+        }
+        state->heap_position[relay] = -1;
+        relay_heap_update(state, relay);
+    }
+
+    for(gint i = 0; i < ndownloads; i++) {
+        for(gint j = 0; j < 3; j++) {
+            gint relay = state->paths[3 * i + j];
+            state->relay_downloads[state->ends[relay]++] = i;
+        }
+    }
+
+    gdouble total_bandwidth = 0;
+
+    /* loop through all relays until there are no longer
+     * any active relays or active downloads */
+    while(state->nactive_relays > 0 && state->nloaded_relays > 0) {
+        /* 2. find relay with smallest per download bandwidth, ties going to
+         * the lowest relay id */
+        if(!state->nheap) {
+            g_error("[ERROR] no bottleneck relay found somehow, must be done");
+            continue;
+        }
+
+        gint bottleneck_relay = state->heap[0];
+        gdouble download_bandwidth = state->share[bottleneck_relay];
+
+        gint nbottleneck_downloads = state->ndownloads[bottleneck_relay];
+        state->bandwidth[bottleneck_relay] = download_bandwidth * nbottleneck_downloads;
+
+        /* if there is a weight array, update the DWC weight */
+        if(weights) {
+            weights[bottleneck_relay] = (1.0 / download_bandwidth) * nbottleneck_downloads;
+        }
+
+        /* 3. go through all relay downloads, assign them the bottleneck bandwidth,
+         * and decrement the bandwidth of the relays on the download circuit */
+        for(gint i = state->offsets[bottleneck_relay]; i < state->ends[bottleneck_relay]; i++) {
+            gint position = state->relay_downloads[i];
+            if(state->assigned[position]) {
+                continue;
+            }
+            state->assigned[position] = TRUE;
+
+            gint *path = state->paths + 3 * position;
+            total_bandwidth += download_bandwidth;
+            if(rates) {
+                rates[downloads[position]] = download_bandwidth;
+            }
+
+            /* update bandwidth of relays on the circuit */
+            update_relays(state, path[0], download_bandwidth);
+            update_relays(state, path[1], download_bandwidth);
+            update_relays(state, path[2], download_bandwidth);
+
+            /* remove download from relay download lists */
+            remove_download_from_relay(state, path[0]);
+            remove_download_from_relay(state, path[1]);
+            remove_download_from_relay(state, path[2]);
+
+            relay_heap_update(state, path[0]);
+            relay_heap_update(state, path[1]);
+            relay_heap_update(state, path[2]);
+        }
+
+        if(state->active[bottleneck_relay]) {
+            g_error("bottleneck relay %s still has bandwidth %f available", network->relay_names[bottleneck_relay],
+                    state->bandwidth[bottleneck_relay]);
+        }
+        if(state->ndownloads[bottleneck_relay]) {
+            g_error("bottleneck relay %s still has downloads", network->relay_names[bottleneck_relay]);
+        }
+    }
+
+    for(gint i = 0; i < state->nrelays; i++) {
+        gint relay = state->relays[i];
+        if(available_bandwidth) {
+            available_bandwidth[relay] = state->active[relay] ? (gint)state->bandwidth[relay] : 0;
+        }
+        state->ndownloads[relay] = 0;
+    }
+
+    return total_bandwidth;
+}
+
+static gint relay_root(gint *parent, gint relay) {
+    while(parent[relay] != relay) {
+        parent[relay] = parent[parent[relay]];
+        relay = parent[relay];
+    }
+    return relay;
+}
+
+static void relay_union(gint *parent, gint relay1, gint relay2) {
+    relay1 = relay_root(parent, relay1);
+    relay2 = relay_root(parent, relay2);
+    if(relay1 != relay2) {
+        parent[MAX(relay1, relay2)] = MIN(relay1, relay2);
+    }
+}
+
+/* as progressive_filling with each download's guard, middle and exit relay
+ * ids given in paths, downloads only being read to store rates.  Downloads
+ * are split by union-find over their relays into components that share no
+ * relay and each is filled on its own, rates and weights coming out as they
+ * would from filling them together.  The state comes from arena, per relay
+ * entries only being read once a download on the relay has set them */
+static gdouble progressive_filling_paths(network_t *network, gint *downloads, gint ndownloads, gint *paths,
+        gdouble *capacity, gdouble *rates, gdouble *weights, gint *available_bandwidth, solver_arena_t *arena) {
+    g_assert(network);
+
+    gint nrelays = network->nrelays;
+    solver_state_t state;
+    state.bandwidth = solver_arena_new(arena, gdouble, nrelays);
+    state.active = solver_arena_new(arena, gboolean, nrelays);
+    state.ndownloads = solver_arena_new(arena, gint, nrelays);
+    state.offsets = solver_arena_new(arena, gint, nrelays);
+    state.ends = solver_arena_new(arena, gint, nrelays);
+    state.relay_downloads = solver_arena_new(arena, gint, 3 * ndownloads);
+    state.assigned = solver_arena_new(arena, gboolean, ndownloads);
+    state.relays = solver_arena_new(arena, gint, nrelays);
+    state.share = solver_arena_new(arena, gdouble, nrelays);
+    state.heap = solver_arena_new(arena, gint, nrelays);
+    state.heap_position = solver_arena_new(arena, gint, nrelays);
+    memset(state.ndownloads, 0, nrelays * sizeof(gint));
+
+    if(weights) {
+        memset(weights, 0, nrelays * sizeof(gdouble));
+    }
+    if(available_bandwidth) {
+        for(gint relay = 0; relay < nrelays; relay++) {
+            available_bandwidth[relay] = network->relay_bandwidth[relay];
+        }
+    }
+
+    /* components are numbered in order of their first download */
+    gint *parent = solver_arena_new(arena, gint, nrelays);
+    for(gint i = 0; i < 3 * ndownloads; i++) {
+        parent[paths[i]] = paths[i];
+    }
+    for(gint i = 0; i < ndownloads; i++) {
+        relay_union(parent, paths[3 * i], paths[3 * i + 1]);
+        relay_union(parent, paths[3 * i], paths[3 * i + 2]);
+    }
+
+    gint *component_index = solver_arena_new(arena, gint, nrelays);
+    gint *component = solver_arena_new(arena, gint, ndownloads);
+    gint *component_start = solver_arena_new(arena, gint, ndownloads + 1);
+    gint ncomponents = 0;
+    for(gint i = 0; i < ndownloads; i++) {
+        component_index[relay_root(parent, paths[3 * i])] = -1;
+    }
+    for(gint i = 0; i < ndownloads; i++) {
+        gint root = relay_root(parent, paths[3 * i]);
+        if(component_index[root] == -1) {
+            component_start[ncomponents] = 0;
+            component_index[root] = ncomponents++;
+        }
+        component[i] = component_index[root];
+        component_start[component[i]]++;
+    }
+
+    if(ncomponents <= 1) {
+        return solve_component(&state, network, downloads, ndownloads, paths, capacity, rates, weights,
+                available_bandwidth);
+    }
+
+    /* lay the components out one after another, downloads keeping their order */
+    gint start = 0;
+    for(gint c = 0; c < ncomponents; c++) {
+        gint count = component_start[c];
+        component_start[c] = start;
+        start += count;
+    }
+    component_start[ncomponents] = start;
+
+    gint *component_paths = solver_arena_new(arena, gint, 3 * ndownloads);
+    gint *component_downloads = downloads ? solver_arena_new(arena, gint, ndownloads) : NULL;
+    gint *fill = state.offsets;
+    memcpy(fill, component_start, ncomponents * sizeof(gint));
+    for(gint i = 0; i < ndownloads; i++) {
+        gint position = fill[component[i]]++;
+        memcpy(component_paths + 3 * position, paths + 3 * i, 3 * sizeof(gint));
+        if(downloads) {
+            component_downloads[position] = downloads[i];
+        }
+    }
+
+    gdouble total_bandwidth = 0;
+    for(gint c = 0; c < ncomponents; c++) {
+        gint first = component_start[c];
+        total_bandwidth += solve_component(&state, network, component_downloads ? component_downloads + first : NULL,
+                component_start[c + 1] - first, component_paths + 3 * first, capacity, rates, weights,
+                available_bandwidth);
+    }
+
+    return total_bandwidth;
+}
+
+gdouble progressive_filling(network_t *network, gint *downloads, gint ndownloads, gint *circuit_selection,
+        gdouble *capacity, gdouble *rates, gdouble *weights, gint *available_bandwidth) {
+    solver_arena_t *arena = solver_arena_reset(solver_arena_bytes(network->nrelays, ndownloads));
+    gint *paths = solver_arena_new(arena, gint, 3 * ndownloads);
+    for(gint i = 0; i < ndownloads; i++) {
+        network_circuit_path(network, circuit_selection[downloads[i]], paths + 3 * i);
+    }
+
+    return progressive_filling_paths(network, downloads, ndownloads, paths, capacity, rates,
+            weights, available_bandwidth, arena);
+}
+
+gdouble compute_download_bandwidths(network_t *network, active_set_t *active_downloads, gint *circuit_selection, gdouble *weights, gint *available_bandwidth) {
+    g_assert(active_downloads);
+    return progressive_filling(network, active_downloads->downloads, active_downloads->ndownloads,
+            circuit_selection, NULL, NULL, weights, available_bandwidth);
+}
+
+/*
+ * Incremental max-min fairness across ticks
+ *
+ * Progressive filling raises every unassigned download's rate together, so
+ * the allocation below the first level at which any arrival or departure
+ * changes a relay's saturation is unchanged.  Downloads frozen below that
+ * level keep their rates, and of the rest only those connected through
+ * shared relays to a changed download are solved again, against the relay
+ * capacity left over by the downloads that keep their rate.
+ */
+
+enum {
+    DOWNLOAD_INACTIVE = 0,
+    DOWNLOAD_SOLVED,
+    DOWNLOAD_PENDING,
+};
+
+typedef struct fairness_engine_s {
+    network_t *network;
+    gint *circuit_selection;
+    active_set_t *active;
+    active_set_t *pending;
+    gint *state;
+    gdouble *rates;
+    gint **relay_downloads;
+    gint *relay_ndownloads;
+    gint *relay_size;
+    gint *slots;
+    gint *paths;
+    gint *seed_relays;
+    gint nseed_relays;
+    gdouble level;
+    gint *relay_mark;
+    gint *download_mark;
+    gint stamp;
+    gint *queue;
+    gint *affected;
+    gdouble *capacity;
+    gdouble *scratch;
+    gdouble total_bandwidth;
+    guint64 path_hash;
+} fairness_engine_t;
+
+fairness_engine_t *fairness_engine_new(network_t *network, gint *circuit_selection) {
+    fairness_engine_t *engine = g_new0(fairness_engine_t, 1);
+    engine->network = network;
+    engine->circuit_selection = circuit_selection;
+    engine->active = active_set_new(network->ndownloads);
+    engine->pending = active_set_new(network->ndownloads);
+    engine->state = g_new0(gint, network->ndownloads);
+    engine->rates = g_new0(gdouble, network->ndownloads);
+    engine->relay_downloads = (gint **)g_new0(gpointer, network->nrelays);
+    engine->relay_ndownloads = g_new0(gint, network->nrelays);
+    engine->relay_size = g_new0(gint, network->nrelays);
+    engine->slots = g_new0(gint, 3 * network->ndownloads);
+    engine->paths = g_new0(gint, 3 * network->ndownloads);
+    engine->seed_relays = g_new0(gint, 3 * network->ndownloads);
+    engine->level = G_MAXDOUBLE;
+    engine->relay_mark = g_new0(gint, network->nrelays);
+    engine->download_mark = g_new0(gint, network->ndownloads);
+    engine->queue = g_new0(gint, network->nrelays);
+    engine->affected = g_new0(gint, network->ndownloads);
+    engine->capacity = g_new0(gdouble, network->nrelays);
+    engine->scratch = g_new0(gdouble, network->ndownloads);
+    return engine;
+}
+
+void fairness_engine_free(fairness_engine_t *engine) {
+    for(gint i = 0; i < engine->network->nrelays; i++) {
+        g_free(engine->relay_downloads[i]);
+    }
+    active_set_free(engine->active);
+    active_set_free(engine->pending);
+    g_free(engine->state);
+    g_free(engine->rates);
+    g_free(engine->relay_downloads);
+    g_free(engine->relay_ndownloads);
+    g_free(engine->relay_size);
+    g_free(engine->slots);
+    g_free(engine->paths);
+    g_free(engine->seed_relays);
+    g_free(engine->relay_mark);
+    g_free(engine->download_mark);
+    g_free(engine->queue);
+    g_free(engine->affected);
+    g_free(engine->capacity);
+    g_free(engine->scratch);
+    g_free(engine);
+}
+
+/* relays of an active download's circuit, resolved when it was added */
+static gint *engine_path(fairness_engine_t *engine, gint download) {
+    return engine->paths + 3 * download;
+}
+
+/* splitmix64's finalizer */
+static inline guint64 hash_mix(guint64 z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static guint64 path_hash(gint *path) {
+    guint64 hash = hash_mix((guint64)path[0] + 0x9e3779b97f4a7c15ULL);
+    hash = hash_mix(hash ^ (guint32)path[1]);
+    return hash_mix(hash ^ (guint32)path[2]);
+}
+
+/* hash of the multiset of active paths, the sum of their hashes being kept
+ * up to date as downloads arrive and depart.  It is never 0 */
+static guint64 fairness_engine_key(fairness_engine_t *engine) {
+    return hash_mix(engine->path_hash + (guint64)engine->active->ndownloads * 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+void fairness_engine_add(fairness_engine_t *engine, gint download) {
+    if(engine->state[download] != DOWNLOAD_INACTIVE) {
+        return;
+    }
+
+    gint *path = engine_path(engine, download);
+    network_circuit_path(engine->network, engine->circuit_selection[download], path);
+    for(gint i = 0; i < 3; i++) {
+        gint relay = path[i];
+        if(engine->relay_ndownloads[relay] == engine->relay_size[relay]) {
+            engine->relay_size[relay] = MAX(4, 2 * engine->relay_size[relay]);
+            engine->relay_downloads[relay] = g_renew(gint, engine->relay_downloads[relay], engine->relay_size[relay]);
+        }
+        engine->slots[3 * download + i] = engine->relay_ndownloads[relay];
+        engine->relay_downloads[relay][engine->relay_ndownloads[relay]++] = download;
+    }
+    engine->path_hash += path_hash(path);
+
+    engine->state[download] = DOWNLOAD_PENDING;
+    active_set_add(engine->active, download);
+    active_set_add(engine->pending, download);
+}
+
+void fairness_engine_remove(fairness_engine_t *engine, gint download) {
+    if(engine->state[download] == DOWNLOAD_INACTIVE) {
+        return;
+    }
+
+    gint *path = engine_path(engine, download);
+    for(gint i = 0; i < 3; i++) {
+        gint relay = path[i];
+        gint idx = engine->slots[3 * download + i];
+        gint last_idx = --engine->relay_ndownloads[relay];
+        gint last = engine->relay_downloads[relay][last_idx];
+        engine->relay_downloads[relay][idx] = last;
+
+        /* point the moved download's slot for this relay at its new index */
+        gint *last_path = engine_path(engine, last);
+        for(gint j = 0; j < 3; j++) {
+            if(last_path[j] == relay && engine->slots[3 * last + j] == last_idx) {
+                engine->slots[3 * last + j] = idx;
+                break;
             }
         }
     }
 
-    gdouble total_bandwidth = 0;
+    engine->path_hash -= path_hash(path);
 
-    gint ncircuits = 0;
+    if(engine->state[download] == DOWNLOAD_PENDING) {
+        active_set_remove(engine->pending, download);
+    } else {
+        /* nothing below the departed download's rate can change */
+        engine->level = MIN(engine->level, engine->rates[download]);
+        for(gint i = 0; i < 3; i++) {
+            engine->seed_relays[engine->nseed_relays++] = path[i];
+        }
+    }
 
-    /* loop through all relays until there are no longer
-     * any active relays or active downloads */
-    while(g_hash_table_size(active_relays) > 0 && g_hash_table_size(relay_downloads) > 0) {
-        gchar *bottleneck_relay = NULL;
-        gdouble bottleneck_bandwidth = G_MAXINT32;
-        gdouble download_bandwidth = G_MAXINT32;
+    engine->state[download] = DOWNLOAD_INACTIVE;
+    active_set_remove(engine->active, download);
+}
 
+static int compare_rate(const void *p1, const void *p2) {
+    gdouble a = *(const gdouble *)p1;
+    gdouble b = *(const gdouble *)p2;
+    return (a > b) - (a < b);
+}
 
-        /* 2. find relay with smallest per download bandwidth */
-        GHashTableIter iter;
-        gpointer key,value;
-        g_hash_table_iter_init(&iter, active_relays);
-        while(g_hash_table_iter_next(&iter, &key, &value)) {
-            gchar *relay = (gchar *)key;
-            gdouble bandwidth = *((gdouble *)value);
-            if(!bandwidth) {
-                g_warning("relay %s has 0 bandwidth, should not be in active list", relay);
-                continue;
+/* lowest fill level at which the relay saturates when its solved downloads keep
+ * their previous rates and its pending downloads are filled from zero */
+static gdouble relay_saturation_level(fairness_engine_t *engine, gint relay) {
+    gint nsolved = 0;
+    gint npending = 0;
+    for(gint i = 0; i < engine->relay_ndownloads[relay]; i++) {
+        gint download = engine->relay_downloads[relay][i];
+        if(engine->state[download] == DOWNLOAD_SOLVED) {
+            engine->scratch[nsolved++] = engine->rates[download];
+        } else {
+            npending++;
+        }
+    }
+    qsort(engine->scratch, nsolved, sizeof(gdouble), compare_rate);
+
+    gdouble remaining = engine->network->relay_bandwidth[relay];
+    for(gint i = 0; i < nsolved; i++) {
+        gdouble level = remaining / (nsolved - i + npending);
+        if(level <= engine->scratch[i]) {
+            return MAX(level, 0);
+        }
+        remaining -= engine->scratch[i];
+    }
+
+    return npending ? MAX(remaining / npending, 0) : G_MAXDOUBLE;
+}
+
+static void engine_visit_relay(fairness_engine_t *engine, gint relay, gint *nqueue) {
+    if(engine->relay_mark[relay] != engine->stamp) {
+        engine->relay_mark[relay] = engine->stamp;
+        engine->queue[(*nqueue)++] = relay;
+    }
+}
+
+static void engine_visit_download(fairness_engine_t *engine, gint download, gint *naffected, gint *nqueue) {
+    engine->download_mark[download] = engine->stamp;
+    engine->affected[(*naffected)++] = download;
+
+    gint *path = engine_path(engine, download);
+    for(gint i = 0; i < 3; i++) {
+        engine_visit_relay(engine, path[i], nqueue);
+    }
+}
+
+gdouble fairness_engine_solve(fairness_engine_t *engine) {
+    if(!engine->pending->ndownloads && !engine->nseed_relays) {
+        return engine->total_bandwidth;
+    }
+
+    /* 1. find the fill level below which the previous allocation still holds */
+    gdouble level = engine->level;
+    engine->stamp++;
+    for(gint i = 0; i < engine->pending->ndownloads; i++) {
+        gint *path = engine_path(engine, engine->pending->downloads[i]);
+        for(gint j = 0; j < 3; j++) {
+            gint relay = path[j];
+            if(engine->relay_mark[relay] != engine->stamp) {
+                engine->relay_mark[relay] = engine->stamp;
+                level = MIN(level, relay_saturation_level(engine, relay));
             }
-            GHashTable *relay_download_list = g_hash_table_lookup(relay_downloads, relay);
-            if(!relay_download_list) {
+        }
+    }
+    gdouble fixed_level = level * (1 - 1e-9);
+
+    /* 2. collect the downloads at or above that level which share relays,
+     * directly or transitively, with an arriving or departing download */
+    engine->stamp++;
+    gint naffected = 0;
+    gint nqueue = 0;
+    for(gint i = 0; i < engine->pending->ndownloads; i++) {
+        engine_visit_download(engine, engine->pending->downloads[i], &naffected, &nqueue);
+    }
+    for(gint i = 0; i < engine->nseed_relays; i++) {
+        engine_visit_relay(engine, engine->seed_relays[i], &nqueue);
+    }
+
+    for(gint head = 0; head < nqueue; head++) {
+        gint relay = engine->queue[head];
+        for(gint i = 0; i < engine->relay_ndownloads[relay]; i++) {
+            gint download = engine->relay_downloads[relay][i];
+            if(engine->download_mark[download] == engine->stamp || engine->rates[download] < fixed_level) {
                 continue;
             }
+            engine_visit_download(engine, download, &naffected, &nqueue);
+        }
+    }
 
-            gint ndownloads = g_hash_table_size(relay_download_list);
-            if(bandwidth / ndownloads < download_bandwidth) {
-                bottleneck_relay = relay;
-                bottleneck_bandwidth = bandwidth;
-                download_bandwidth = bandwidth / ndownloads;
+    /* 3. relays offer whatever the downloads keeping their rate leave over */
+    for(gint head = 0; head < nqueue; head++) {
+        gint relay = engine->queue[head];
+        gdouble capacity = engine->network->relay_bandwidth[relay];
+        for(gint i = 0; i < engine->relay_ndownloads[relay]; i++) {
+            gint download = engine->relay_downloads[relay][i];
+            if(engine->download_mark[download] != engine->stamp) {
+                capacity -= engine->rates[download];
             }
         }
+        engine->capacity[relay] = MAX(capacity, 0);
+    }
 
-        if(!bottleneck_relay) {
-            g_error("[ERROR] no bottleneck relay found somehow, must be done");
-            continue;
+    progressive_filling(engine->network, engine->affected, naffected, engine->circuit_selection,
+            engine->capacity, engine->rates, NULL, NULL);
+
+    for(gint i = 0; i < naffected; i++) {
+        engine->state[engine->affected[i]] = DOWNLOAD_SOLVED;
+    }
+
+    while(engine->pending->ndownloads) {
+        active_set_remove(engine->pending, engine->pending->downloads[0]);
+    }
+    engine->nseed_relays = 0;
+    engine->level = G_MAXDOUBLE;
+
+    engine->total_bandwidth = 0;
+    for(gint i = 0; i < engine->active->ndownloads; i++) {
+        engine->total_bandwidth += engine->rates[engine->active->downloads[i]];
+    }
+
+    g_debug("re-solved %d of %d active downloads above level %f", naffected,
+            engine->active->ndownloads, level);
+
+    return engine->total_bandwidth;
+}
+
+/*
+ * Tick solve cache
+ *
+ * A tick's bandwidth only depends on the paths of its active downloads, and
+ * across a GA population that has mostly converged the same active paths come
+ * up on many ticks of many experiments.  Ticks are looked up by the engine's
+ * key in a fixed number of direct mapped slots, a newer entry replacing
+ * whatever held its slot.  Only the key is compared, not the paths, so two
+ * active sets that collide on the 64 bit key share a bandwidth; that is
+ * accepted as vanishingly rare.  The slots are only read while a round is
+ * evaluated; each experiment keeps the ticks it had to solve and they are
+ * stored after the round in experiment order, so a seed still gives the same
+ * run and a hit always comes from an earlier round.
+ */
+
+typedef struct solve_cache_entry_s {
+    guint64 key;
+    gint bandwidth;
+} solve_cache_entry_t;
+
+struct solve_cache_s {
+    solve_cache_entry_t *slots;
+    guint64 mask;
+    gint nhits;
+    gint nmisses;
+};
+
+solve_cache_t *solve_cache_new(gint nslots) {
+    g_assert(nslots > 0);
+
+    guint64 size = 1;
+    while(size < (guint64)nslots) {
+        size <<= 1;
+    }
+
+    solve_cache_t *cache = g_new0(solve_cache_t, 1);
+    cache->slots = g_new0(solve_cache_entry_t, size);
+    cache->mask = size - 1;
+    return cache;
+}
+
+void solve_cache_free(solve_cache_t *cache) {
+    g_free(cache->slots);
+    g_free(cache);
+}
+
+gboolean solve_cache_lookup(solve_cache_t *cache, guint64 key, gint *bandwidth) {
+    solve_cache_entry_t *entry = &cache->slots[key & cache->mask];
+    if(entry->key == key) {
+        *bandwidth = entry->bandwidth;
+        g_atomic_int_inc(&cache->nhits);
+        return TRUE;
+    }
+    g_atomic_int_inc(&cache->nmisses);
+    return FALSE;
+}
+
+/* stores and empties misses, must not run alongside lookups */
+void solve_cache_store(solve_cache_t *cache, GArray *misses) {
+    for(guint i = 0; i < misses->len; i++) {
+        solve_cache_entry_t *entry = &g_array_index(misses, solve_cache_entry_t, i);
+        cache->slots[entry->key & cache->mask] = *entry;
+    }
+    g_array_set_size(misses, 0);
+}
+
+/* a run of consecutive ticks solved on its own, starting from the downloads
+ * that are active before its first tick */
+typedef struct timeline_segment_s {
+    GList *first_tick;
+    gint start_idx;
+    gint end_idx;
+    gint *active_downloads;
+    gint nactive_downloads;
+    gint nsolved;
+    GArray *cache_misses;
+} timeline_segment_t;
+
+/* with a cache ticks that have to be solved are first looked up in it, the
+ * ones that miss being appended to cache_misses */
+typedef struct timeline_data_s {
+    network_t *network;
+    gint *circuit_selection;
+    GHashTable *downloads_by_tick;
+    gint *tick_bandwidth;
+    gint *reference_bandwidth;
+    guint8 *dirty;
+    solve_cache_t *cache;
+    GArray *cache_misses;
+    timeline_segment_t *segments;
+} timeline_data_t;
+
+static void timeline_segment_worker(gint start, gint end, gpointer user_data) {
+    timeline_data_t *data = (timeline_data_t *)user_data;
+    gint *circuit_selection = data->circuit_selection;
+
+    for(gint s = start; s < end; s++) {
+        timeline_segment_t *segment = &data->segments[s];
+
+        /* only the downloads affected by each tick's arrivals and departures are re-solved */
+        fairness_engine_t *engine = fairness_engine_new(data->network, circuit_selection);
+        for(gint i = 0; i < segment->nactive_downloads; i++) {
+            fairness_engine_add(engine, segment->active_downloads[i]);
         }
 
-        GHashTable *downloads = g_hash_table_lookup(relay_downloads, bottleneck_relay);
-        GList *download_list = g_hash_table_get_keys(downloads);
+        GList *iter = segment->first_tick;
+        for(gint idx = segment->start_idx; idx < segment->end_idx; idx++, iter = g_list_next(iter)) {
+            gint tick = GPOINTER_TO_INT(iter->data);
+            GQueue *tick_downloads = g_hash_table_lookup(data->downloads_by_tick, GINT_TO_POINTER(tick));
+
+            for(GList *diter = g_queue_peek_head_link(tick_downloads); diter; diter = g_list_next(diter)) {
+                download_t *download = diter->data;
+
+                if(circuit_selection[download->id] != -1) {
+                    if(download->start_time == tick) {
+                        fairness_engine_add(engine, download->id);
+                    } else if(download->end_time == tick) {
+                        fairness_engine_remove(engine, download->id);
+                    } else {
+                        g_error("download from %d to %d in list for tick %d", download->start_time, download->end_time, tick);
+                    }
+                }
+            }
+
+            gdouble bandwidth;
+            gint cached_bandwidth;
+            if(!data->reference_bandwidth || data->dirty[idx]) {
+                guint64 key = data->cache ? fairness_engine_key(engine) : 0;
+                if(data->cache && solve_cache_lookup(data->cache, key, &cached_bandwidth)) {
+                    bandwidth = cached_bandwidth;
+                } else {
+                    bandwidth = fairness_engine_solve(engine);
+                    segment->nsolved++;
+
+                    if(data->cache) {
+                        solve_cache_entry_t entry = {key, (gint)bandwidth};
+                        if(!segment->cache_misses) {
+                            segment->cache_misses = g_array_new(FALSE, FALSE, sizeof(solve_cache_entry_t));
+                        }
+                        g_array_append_val(segment->cache_misses, entry);
+                    }
+                }
+            } else {
+                bandwidth = data->reference_bandwidth[idx];
+            }
+            data->tick_bandwidth[idx] = (gint)bandwidth;
 
-        /*g_debug("bottleneck relay is %s (%f) with %d downloads and %f per download bandwidth",*/
-                /*bottleneck_relay, bottleneck_bandwidth, g_list_length(download_list), download_bandwidth);*/
+            g_debug("[%f] %d downloads, bandwidth %f MBps", tick / 1000.0,
+                    engine->active->ndownloads, bandwidth / 1024.0);
+        }
 
-        ncircuits += g_hash_table_size(downloads);
+        fairness_engine_free(engine);
+    }
+}
 
-        gdouble *bw = g_hash_table_lookup(active_relays, bottleneck_relay);
-        *bw = download_bandwidth * g_hash_table_size(downloads);
+/* applies a tick's arrivals and departures of downloads that have a circuit */
+static void apply_tick_events(active_set_t *active, GQueue *tick_downloads, gint tick, gint *circuit_selection) {
+    for(GList *diter = g_queue_peek_head_link(tick_downloads); diter; diter = g_list_next(diter)) {
+        download_t *download = diter->data;
 
-        /* if there is a weight hash table, update the DWC weight */
-        if(weights) {
-            gdouble *weight = g_hash_table_lookup(weights, bottleneck_relay);
-            if(!weight) {
-                weight = g_new0(gdouble, 1);
-                g_hash_table_insert(weights, bottleneck_relay, weight);
+        if(circuit_selection[download->id] != -1) {
+            if(download->start_time == tick) {
+                active_set_add(active, download->id);
+            } else if(download->end_time == tick) {
+                active_set_remove(active, download->id);
             }
-            *weight = (1.0 / download_bandwidth) * g_hash_table_size(downloads);
         }
+    }
+}
 
+/* solves ticks [start_idx, end_idx), the first of which is first_tick, into
+ * data->tick_bandwidth with initial holding the downloads active before it.
+ * With an executor the range is split into nsegments runs that are solved in
+ * parallel, each seeded with the active downloads found by a prefix pass over
+ * the earlier ticks.  Returns the number of ticks solved. */
+static gint solve_timeline(timeline_data_t *data, GList *first_tick, gint start_idx, gint end_idx,
+        active_set_t *initial, executor_t *executor, gint nsegments) {
+    gint nticks = end_idx - start_idx;
+    if(nticks <= 0) {
+        return 0;
+    }
+    if(!executor || nsegments < 1) {
+        nsegments = 1;
+    }
+    nsegments = MAX(MIN(nsegments, nticks), 1);
 
-        /* 3. go through all relay downloads, assign them the bottleneck bandwidth,
-         * and decrement the bandwidth of the relays on the download circuit */
-        for(GList *iter = download_list; iter; iter = g_list_next(iter)) {
-            download_t *download = (download_t *)iter->data;
-            circuit_t *circuit = g_hash_table_lookup(circuit_selection, download);
+    data->segments = g_new0(timeline_segment_t, nsegments);
 
-            download->bandwidth = download_bandwidth;
-            download->bottleneck = bottleneck_relay;
-            total_bandwidth += download_bandwidth;
+    /* prefix pass recording the tick each segment starts at and what is active before it */
+    active_set_t *active = active_set_new(data->network->ndownloads);
+    if(initial) {
+        for(gint i = 0; i < initial->ndownloads; i++) {
+            active_set_add(active, initial->downloads[i]);
+        }
+    }
 
-            g_debug("updating download with circuit %s,%s,%s",
-                    circuit->guard, circuit->middle, circuit->exit);
-    
-            /* update bandwidth of relays on the circuit */
-            update_relays(active_relays, circuit->guard, download_bandwidth);
-            update_relays(active_relays, circuit->middle, download_bandwidth);
-            update_relays(active_relays, circuit->exit, download_bandwidth);
+    GList *iter = first_tick;
+    for(gint s = 0, idx = start_idx; s < nsegments; s++) {
+        timeline_segment_t *segment = &data->segments[s];
+        segment->start_idx = start_idx + (gint)((gint64)nticks * s / nsegments);
+        segment->end_idx = start_idx + (gint)((gint64)nticks * (s + 1) / nsegments);
 
-            /* remove download from relay download lists */
-            remove_download_from_relay(relay_downloads, circuit->guard, download);
-            remove_download_from_relay(relay_downloads, circuit->middle, download);
-            remove_download_from_relay(relay_downloads, circuit->exit, download);
+        for(; idx < segment->start_idx; idx++, iter = g_list_next(iter)) {
+            gint tick = GPOINTER_TO_INT(iter->data);
+            apply_tick_events(active, g_hash_table_lookup(data->downloads_by_tick, GINT_TO_POINTER(tick)),
+                    tick, data->circuit_selection);
         }
-        g_list_free(download_list);
 
-        if(g_hash_table_lookup(active_relays, bottleneck_relay)) {
-            g_error("bottleneck relay %s still has bandwidth %d available", bottleneck_relay,
-                    GPOINTER_TO_INT(g_hash_table_lookup(active_relays, bottleneck_relay)));
+        segment->first_tick = iter;
+        if(active->ndownloads) {
+            segment->active_downloads = g_new(gint, active->ndownloads);
+            memcpy(segment->active_downloads, active->downloads, active->ndownloads * sizeof(gint));
+            segment->nactive_downloads = active->ndownloads;
         }
-        if(g_hash_table_lookup(relay_downloads, bottleneck_relay)) {
-            g_error("bottleneck relay %s still has downloads", bottleneck_relay);
+
+        if(nsegments == 1) {
+            break;
         }
     }
+    active_set_free(active);
 
-    /*g_debug("we saw %d circuits, %d active relays left, %d active downloads left", ncircuits,*/
-            /*g_hash_table_size(active_relays), g_hash_table_size(relay_downloads));*/
-
-    GList *download_lists = g_hash_table_get_values(relay_downloads);
-    for(GList *iter = download_lists; iter; iter = g_list_next(iter)) {
-        g_queue_free((GQueue *)iter->data);
+    if(nsegments > 1) {
+        executor_parallel_for(executor, 0, nsegments, 1, timeline_segment_worker, data);
+    } else {
+        timeline_segment_worker(0, nsegments, data);
     }
-    g_list_free(download_lists);
 
-    if(available_bandwidth) {
-        g_hash_table_iter_init(&iter, active_relays);
-        while(g_hash_table_iter_next(&iter, &key, &value)) {
-            gchar *relay = (gchar *)key;
-            gdouble *bandwidth = (gdouble *)value;
-            g_hash_table_insert(available_bandwidth, relay, GINT_TO_POINTER((gint)(*bandwidth)));
+    gint nsolved = 0;
+    for(gint s = 0; s < nsegments; s++) {
+        timeline_segment_t *segment = &data->segments[s];
+        nsolved += segment->nsolved;
+        if(segment->cache_misses) {
+            g_array_append_vals(data->cache_misses, segment->cache_misses->data, segment->cache_misses->len);
+            g_array_free(segment->cache_misses, TRUE);
         }
+        g_free(segment->active_downloads);
     }
+    g_free(data->segments);
+    data->segments = NULL;
 
-    g_hash_table_destroy(active_relays);
-    g_hash_table_destroy(relay_downloads);
-
-    return total_bandwidth;
+    return nsolved;
 }
 
-gdouble compute_total_bandwidth(GQueue *downloads, GHashTable *relays, GHashTable *circuit_selection, GHashTable *downloads_by_tick, GQueue *ticks) {
-    g_assert(downloads);
-    g_assert(relays);
+/* total bandwidth over the timeline, storing each tick's bandwidth in
+ * tick_bandwidth if given.  When reference_bandwidth is given only the ticks
+ * marked dirty are solved and the rest take the reference's bandwidth.  With
+ * a solve cache those ticks are looked up first and the ones that had to be
+ * solved are appended to cache_misses.  The ticks are split into nsegments
+ * solved in parallel on the executor. */
+gdouble compute_total_bandwidth_cached(network_t *network, gint *circuit_selection, GHashTable *downloads_by_tick,
+        GQueue *ticks, gint *tick_bandwidth, gint *reference_bandwidth, guint8 *dirty, gint *nticks_solved,
+        solve_cache_t *cache, GArray *cache_misses, executor_t *executor, gint nsegments) {
+    g_assert(network);
     g_assert(downloads_by_tick);
+    g_assert(!reference_bandwidth || dirty);
+    g_assert(!cache || cache_misses);
+
+    gint nticks = g_queue_get_length(ticks);
 
-    GHashTable *active_downloads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    timeline_data_t data;
+    data.network = network;
+    data.circuit_selection = circuit_selection;
+    data.downloads_by_tick = downloads_by_tick;
+    data.tick_bandwidth = tick_bandwidth ? tick_bandwidth : g_new(gint, nticks);
+    data.reference_bandwidth = reference_bandwidth;
+    data.dirty = dirty;
+    data.cache = cache;
+    data.cache_misses = cache_misses;
+
+    gint nsolved = solve_timeline(&data, g_queue_peek_head_link(ticks), 0, nticks, NULL, executor, nsegments);
 
     gdouble total_bandwidth = 0;
     gint last_tick = -1;
     gint last_bandwidth;
-    for(GList *iter = g_queue_peek_head_link(ticks); iter; iter = g_list_next(iter)) {
+    gint idx = 0;
+    for(GList *iter = g_queue_peek_head_link(ticks); iter; iter = g_list_next(iter), idx++) {
         gint tick = GPOINTER_TO_INT(iter->data);
-        GQueue *tick_downloads = g_hash_table_lookup(downloads_by_tick, GINT_TO_POINTER(tick));
 
-        for(GList *diter = g_queue_peek_head_link(tick_downloads); diter; diter = g_list_next(diter)) {
-            download_t *download = diter->data;
-
-            if(g_hash_table_lookup(circuit_selection, download)) {
-                if(download->start_time == tick) {
-                    g_hash_table_insert(active_downloads, download, GINT_TO_POINTER(TRUE));
-                } else if(download->end_time == tick) {
-                    g_hash_table_remove(active_downloads, download);
-                } else {
-                    g_error("download from %d to %d in list for tick %d", download->start_time, download->end_time, tick);
-                }
-            }
+        if(last_tick != -1) {
+            total_bandwidth += (gdouble)last_bandwidth * (tick - last_tick) / 1000.0;
         }
 
-        gdouble bandwidth = compute_download_bandwidths(active_downloads, relays, circuit_selection, NULL, NULL);
+        last_tick = tick;
+        last_bandwidth = data.tick_bandwidth[idx];
+    }
+
+    if(!tick_bandwidth) {
+        g_free(data.tick_bandwidth);
+    }
 
-        if(last_tick != -1) {
-            total_bandwidth += last_bandwidth * (tick - last_tick) / 1000.0;
+    if(nticks_solved) {
+        *nticks_solved = nsolved;
+    }
+
+    return total_bandwidth;
+}
+
+gdouble compute_total_bandwidth(network_t *network, gint *circuit_selection, GHashTable *downloads_by_tick, GQueue *ticks,
+        executor_t *executor, gint nsegments) {
+    return compute_total_bandwidth_cached(network, circuit_selection, downloads_by_tick, ticks,
+            NULL, NULL, NULL, NULL, NULL, NULL, executor, nsegments);
+}
+
+/*
+ * Coarse timelines
+ *
+ * Every start and end time is moved to the nearest multiple of a bucket
+ * width, so the timeline is only solved at bucket boundaries.  A download
+ * that started and ended in different places but now starts and ends on the
+ * same boundary is dropped, its start and end time being set to -1.  At any
+ * instant no time was moved across, the coarse and exact timeline have the
+ * same active downloads, and elsewhere their bandwidth differs by no more
+ * than the network can carry, a third of all relay bandwidth.  That bounds
+ * how far a coarse score can be from the exact one.
+ */
+
+typedef struct coarse_timeline_s {
+    download_t *download_slab;
+    download_t **downloads;
+    GQueue *download_list;
+    GHashTable *downloads_by_tick;
+    GQueue *ticks;
+    gint width;
+    gdouble error_bound;
+} coarse_timeline_t;
+
+/* moves time to the nearest boundary, keeping the furthest any time was
+ * moved up to and down to each boundary */
+static void coarse_timeline_move(GHashTable *moved_up, GHashTable *moved_down, gint *time, gint width) {
+    gint boundary = (gint)(((gint64)*time + width / 2) / width * width);
+    GHashTable *moved = *time < boundary ? moved_up : moved_down;
+    gint distance = ABS(boundary - *time);
+
+    if(distance > GPOINTER_TO_INT(g_hash_table_lookup(moved, GINT_TO_POINTER(boundary)))) {
+        g_hash_table_insert(moved, GINT_TO_POINTER(boundary), GINT_TO_POINTER(distance));
+    }
+    *time = boundary;
+}
+
+static gint64 coarse_timeline_moved(GHashTable *moved) {
+    gint64 total = 0;
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, moved);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        total += GPOINTER_TO_INT(value);
+    }
+    return total;
+}
+
+coarse_timeline_t *coarse_timeline_new(network_t *network, gint width) {
+    g_assert(network);
+    g_assert(width > 0);
+
+    coarse_timeline_t *timeline = g_new0(coarse_timeline_t, 1);
+    timeline->download_slab = g_new(download_t, network->ndownloads);
+    timeline->downloads = (download_t **)g_new(gpointer, network->ndownloads);
+    timeline->download_list = g_queue_new();
+    timeline->width = width;
+
+    GHashTable *moved_up = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTable *moved_down = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    for(gint i = 0; i < network->ndownloads; i++) {
+        download_t *exact = network->downloads[i];
+        download_t *download = &timeline->download_slab[i];
+        *download = *exact;
+        timeline->downloads[i] = download;
+
+        coarse_timeline_move(moved_up, moved_down, &download->start_time, width);
+        coarse_timeline_move(moved_up, moved_down, &download->end_time, width);
+
+        if(download->start_time == download->end_time && exact->start_time != exact->end_time) {
+            download->start_time = -1;
+            download->end_time = -1;
+        } else {
+            g_queue_push_tail(timeline->download_list, download);
         }
+    }
 
-        g_debug("[%f] %d downloads, bandwidth %f MBps (total %f)", tick / 1000.0, 
-                g_hash_table_size(active_downloads), bandwidth / 1024.0, total_bandwidth / 1024.0);
+    timeline->downloads_by_tick = generate_downloads_by_tick(timeline->download_list);
+    timeline->ticks = g_queue_new();
 
-        last_tick = tick;
-        last_bandwidth = bandwidth;
+    GList *tick_list = g_hash_table_get_keys(timeline->downloads_by_tick);
+    tick_list = g_list_sort(tick_list, (GCompareFunc)compare_int);
+    for(GList *iter = tick_list; iter; iter = g_list_next(iter)) {
+        g_queue_push_tail(timeline->ticks, iter->data);
+    }
+    g_list_free(tick_list);
+
+    gdouble capacity = 0;
+    for(gint i = 0; i < network->nrelays; i++) {
+        capacity += network->relay_bandwidth[i];
     }
+    gint64 moved = coarse_timeline_moved(moved_up) + coarse_timeline_moved(moved_down);
+    timeline->error_bound = capacity / 3 * moved / 1000.0;
 
-    g_hash_table_destroy(active_downloads);
+    g_hash_table_destroy(moved_up);
+    g_hash_table_destroy(moved_down);
 
-    return total_bandwidth;
+    return timeline;
+}
+
+void coarse_timeline_free(coarse_timeline_t *timeline) {
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, timeline->downloads_by_tick);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        g_queue_free((GQueue *)value);
+    }
+    g_hash_table_destroy(timeline->downloads_by_tick);
+    g_queue_free(timeline->ticks);
+    g_queue_free(timeline->download_list);
+    g_free(timeline->downloads);
+    g_free(timeline->download_slab);
+    g_free(timeline);
 }
 
 /*
  * Genetic Algorithm functions
  */
 
-experiment_t **generate_initial_experiments(GQueue *downloads, gdouble weighted, gint n) {
-    experiment_t **experiments = (experiment_t **)g_new0(gpointer, n);
-    for(gint i = 0; i < n; i++) {
-        experiments[i] = g_new0(experiment_t, 1);
-    }
+typedef struct initial_data_s {
+    network_t *network;
+    GQueue *downloads;
+    gboolean weighted;
+    experiment_t **experiments;
+    rng_t *streams;
+} initial_data_t;
 
+static void initial_worker(gint start, gint end, gpointer user_data) {
+    initial_data_t *data = (initial_data_t *)user_data;
 
-    for(gint i = 0; i < n; i++) {
-        experiments[i]->circuit_selection = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for(gint i = start; i < end; i++) {
+        rng_t *rng = &data->streams[i];
 
-        for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
+        for(GList *iter = g_queue_peek_head_link(data->downloads); iter; iter = g_list_next(iter)) {
             download_t *download = (download_t *)iter->data;
-            
-            circuit_t **list = download->circuit_list;
-            gint ncircuits = g_queue_get_length(download->circuits);
 
-            if(weighted) {
-                list = download->weighted_circuit_list;
-                ncircuits = download->total_circuit_bandwidth;
+            gint idx;
+            if(data->weighted) {
+                idx = circuit_sampler_draw(download->circuit_sampler, rng);
+            } else if(download->circuit_list) {
+                idx = rng_int(rng, download->ncircuits);
+            } else {
+                idx = circuit_catalog_draw_uniform(data->network->catalog, rng);
             }
 
-            gint idx = rand() % ncircuits;
-            circuit_t *circuit = list[idx];
-            g_hash_table_insert(experiments[i]->circuit_selection, download, circuit);
+            data->experiments[i]->circuit_selection[download->id] = download_circuit(download, idx);
         }
     }
+}
+
+experiment_t **generate_initial_experiments(network_t *network, GQueue *downloads, gboolean weighted, gint n,
+        gint *selection_slab, rng_t *rng, executor_t *executor) {
+    experiment_t **experiments = (experiment_t **)g_new0(gpointer, n);
+    for(gint i = 0; i < n; i++) {
+        experiments[i] = g_new0(experiment_t, 1);
+        experiments[i]->circuit_selection = selection_slab + (gsize)i * network->ndownloads;
+    }
+
+    initial_data_t data = { network, downloads, weighted, experiments, rng_streams_new(rng, n) };
+    executor_parallel_for(executor, 0, n, 1, initial_worker, &data);
+    g_free(data.streams);
 
     return experiments;
 }
 
-experiment_t *select_parent(experiment_t **experiments, gint nexperiments, gdouble breed_percentile,
-        gboolean breed_weighted) {
+/* parents of one generation are drawn from the top breed percentile, either
+ * uniformly or weighted by score through a Walker alias table, or as the best
+ * of tournament_size experiments drawn from the whole population */
+typedef struct breeding_pool_s {
+    experiment_t **population;
+    gint npopulation;
+    experiment_t **experiments;
+    gint size;
+    gdouble *probability;
+    gint *alias;
+    gint tournament_size;
+} breeding_pool_t;
+
+breeding_pool_t *breeding_pool_new(experiment_t **experiments, gint nexperiments, gdouble breed_percentile,
+        gboolean breed_weighted, gint tournament_size) {
     g_assert(experiments);
 
-    gint breed_size = nexperiments * breed_percentile;
-    experiment_t **breed_experiments = (experiment_t **)g_new0(gpointer, breed_size);
+    breeding_pool_t *pool = g_new0(breeding_pool_t, 1);
+    pool->population = experiments;
+    pool->npopulation = nexperiments;
+    pool->tournament_size = tournament_size;
+    if(tournament_size > 0) {
+        return pool;
+    }
+
+    pool->size = MAX((gint)(nexperiments * breed_percentile), 1);
+    pool->experiments = (experiment_t **)g_new0(gpointer, pool->size);
 
     /* go through and get the top breed percentile experiments */
-    for(gint i = 0; i < breed_size; i++) {
-        breed_experiments[i] = experiments[i];
+    for(gint i = 0; i < pool->size; i++) {
+        pool->experiments[i] = experiments[i];
     }
-    for(gint i = breed_size; i < nexperiments; i++) {
+    for(gint i = pool->size; i < nexperiments; i++) {
         experiment_t *iter = experiments[i];
-        for(gint j = 0; j < breed_size; j++) {
-            if(iter->score > breed_experiments[j]->score) {
-                experiment_t *t = breed_experiments[j];
-                breed_experiments[j] = iter;
+        for(gint j = 0; j < pool->size; j++) {
+            if(iter->score > pool->experiments[j]->score) {
+                experiment_t *t = pool->experiments[j];
+                pool->experiments[j] = iter;
                 iter = t;
             }
         }
     }
 
-    experiment_t *parent;
+    gdouble total_score = 0;
+    for(gint i = 0; i < pool->size; i++) {
+        total_score += MAX(pool->experiments[i]->score, 0);
+    }
+    if(!breed_weighted || total_score <= 0) {
+        return pool;
+    }
 
-    if(!breed_weighted) {
-        gint idx = rand() % breed_size;
-        parent = breed_experiments[idx];
-    } else {
-        gint total_score = 0;
-        for(gint i = 0; i < breed_size; i++) {
-            total_score += (gint)(breed_experiments[i]->score / 1024.0);
+    /* split the scaled scores into columns of height one, each holding at most
+     * two experiments */
+    pool->probability = g_new(gdouble, pool->size);
+    pool->alias = g_new(gint, pool->size);
+    gint *small = g_new(gint, pool->size);
+    gint *large = g_new(gint, pool->size);
+    gint nsmall = 0;
+    gint nlarge = 0;
+
+    for(gint i = 0; i < pool->size; i++) {
+        pool->probability[i] = MAX(pool->experiments[i]->score, 0) * pool->size / total_score;
+        pool->alias[i] = i;
+        if(pool->probability[i] < 1.0) {
+            small[nsmall++] = i;
+        } else {
+            large[nlarge++] = i;
         }
+    }
 
-        experiment_t **weighted_experiments = (experiment_t **)g_new0(gpointer, total_score);
-
-        gint weighted_idx = 0;
-        for(gint i = 0; i < breed_size; i++) {
-            for(gint j = 0; j < (gint)(breed_experiments[i]->score / 1024.0); j++) {
-                weighted_experiments[weighted_idx++] = breed_experiments[i];
-            }
+    while(nsmall && nlarge) {
+        gint s = small[--nsmall];
+        gint l = large[nlarge - 1];
+        pool->alias[s] = l;
+        pool->probability[l] -= 1.0 - pool->probability[s];
+        if(pool->probability[l] < 1.0) {
+            nlarge--;
+            small[nsmall++] = l;
         }
+    }
 
-        gint idx = rand() % total_score;
-        parent = weighted_experiments[idx];
-
-        g_free(weighted_experiments);
+    /* whatever is left only differs from one by rounding */
+    while(nlarge) {
+        pool->probability[large[--nlarge]] = 1.0;
+    }
+    while(nsmall) {
+        pool->probability[small[--nsmall]] = 1.0;
     }
 
-    g_free(breed_experiments);
-        
-    return parent;
-}
+    g_free(small);
+    g_free(large);
 
-void breed(experiment_t **experiments, gint nexperiments, GQueue *downloads, gdouble breed_percentile, 
-        gboolean breed_weighted, gdouble elite_percentile, gdouble mutation_probability) {
-    g_assert(experiments);
+    return pool;
+}
 
-    experiment_t **new_experiments = (experiment_t **)g_new0(gpointer, nexperiments);
+void breeding_pool_free(breeding_pool_t *pool) {
+    g_free(pool->experiments);
+    g_free(pool->probability);
+    g_free(pool->alias);
+    g_free(pool);
+}
 
-    gint nelite = nexperiments * elite_percentile;
+experiment_t *select_parent(breeding_pool_t *pool, rng_t *rng) {
+    g_assert(pool);
 
-    for(gint i = 0; i < nelite; i++) {
-        new_experiments[i] = experiments[i];
-    }
-    for(gint i = nelite; i < nexperiments; i++) {
-        experiment_t *iter = experiments[i];
-        for(gint j = 0; j < nelite; j++) {
-            if(iter->score > new_experiments[j]->score) {
-                experiment_t *t = new_experiments[j];
-                new_experiments[j] = iter;
-                iter = t;
+    if(pool->tournament_size > 0) {
+        experiment_t *parent = NULL;
+        for(gint i = 0; i < pool->tournament_size; i++) {
+            experiment_t *experiment = pool->population[rng_int(rng, pool->npopulation)];
+            if(!parent || experiment->score > parent->score) {
+                parent = experiment;
             }
         }
+        return parent;
     }
 
-    for(gint i = 0; i < nelite; i++) {
-        experiment_t *experiment = new_experiments[i];
-        
-        new_experiments[i] = g_new0(experiment_t, 1);
-        new_experiments[i]->circuit_selection = g_hash_table_new(g_direct_hash, g_direct_equal);
+    if(!pool->probability) {
+        return pool->experiments[rng_int(rng, pool->size)];
+    }
 
-        GHashTableIter iter;
-        gpointer key,value;
+    gdouble r = rng_double(rng) * pool->size;
+    gint idx = (gint)r;
+    return r - idx < pool->probability[idx] ? pool->experiments[idx] : pool->experiments[pool->alias[idx]];
+}
 
-        g_hash_table_iter_init(&iter, experiment->circuit_selection);
-        while(g_hash_table_iter_next(&iter, &key, &value)) {
-            g_hash_table_insert(new_experiments[i]->circuit_selection, key, value);
+typedef struct breed_data_s {
+    network_t *network;
+    breeding_pool_t *pool;
+    experiment_t **elite_experiments;
+    gint nelite;
+    experiment_t *new_experiments;
+    gdouble mutation_probability;
+    gint cache_bank;
+    rng_t *streams;
+} breed_data_t;
+
+static void breed_worker(gint start, gint end, gpointer user_data) {
+    breed_data_t *data = (breed_data_t *)user_data;
+    network_t *network = data->network;
+    gint ndownloads = network->ndownloads;
+    gint cache_bank = data->cache_bank;
+
+    for(gint i = start; i < end; i++) {
+        experiment_t *child = &data->new_experiments[i];
+
+        if(i < data->nelite) {
+            memcpy(child->circuit_selection, data->elite_experiments[i]->circuit_selection,
+                    ndownloads * sizeof(gint));
+            child->reference_bandwidth = data->elite_experiments[i]->tick_bandwidth[cache_bank];
+            continue;
         }
-    }
 
-    for(gint i = nelite; i < nexperiments; i++) {
-        new_experiments[i] = g_new0(experiment_t, 1);
-        new_experiments[i]->circuit_selection = g_hash_table_new(g_direct_hash, g_direct_equal);
-        
-        experiment_t *child = new_experiments[i];
-        experiment_t *parent1 = select_parent(experiments, nexperiments, breed_percentile, breed_weighted);
-        experiment_t *parent2 = select_parent(experiments, nexperiments, breed_percentile, breed_weighted);
+        rng_t *rng = &data->streams[i];
+        experiment_t *parent1 = select_parent(data->pool, rng);
+        experiment_t *parent2 = select_parent(data->pool, rng);
+
+        gint *genes = child->circuit_selection;
+        gint *genes1 = parent1->circuit_selection;
+        gint *genes2 = parent2->circuit_selection;
+        gint nchanged1 = 0;
+        gint nchanged2 = 0;
+
+        for(gint d = 0; d < ndownloads; d++) {
+            g_assert(genes1[d] != -1);
+            g_assert(genes2[d] != -1);
+
+            if(rng_double(rng) < data->mutation_probability) {
+                download_t *download = network->downloads[d];
+                gint idx = download->circuit_list ? rng_int(rng, download->ncircuits) :
+                    circuit_catalog_draw_uniform(network->catalog, rng);
+                genes[d] = download_circuit(download, idx);
+            } else {
+                genes[d] = rng_double(rng) < 0.5 ? genes1[d] : genes2[d];
+            }
 
-        for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
-            download_t *download = iter->data;
-            circuit_t *circuit1 = g_hash_table_lookup(parent1->circuit_selection, download);
-            circuit_t *circuit2 = g_hash_table_lookup(parent2->circuit_selection, download);
+            nchanged1 += genes[d] != genes1[d];
+            nchanged2 += genes[d] != genes2[d];
+        }
+
+        /* delta evaluation is done against whichever parent the child differs from least */
+        if(parent1->tick_bandwidth[cache_bank]) {
+            gint *reference_genes = nchanged1 <= nchanged2 ? genes1 : genes2;
+            child->reference_bandwidth = nchanged1 <= nchanged2 ?
+                parent1->tick_bandwidth[cache_bank] : parent2->tick_bandwidth[cache_bank];
+            child->changed_downloads = g_new(gint, MIN(nchanged1, nchanged2));
+            for(gint d = 0; d < ndownloads; d++) {
+                if(genes[d] != reference_genes[d]) {
+                    child->changed_downloads[child->nchanged_downloads++] = d;
+                }
+            }
+        }
+    }
+}
 
-            g_assert(circuit1);
-            g_assert(circuit2);
+void breed(experiment_t **experiments, gint nexperiments, network_t *network, gdouble breed_percentile, 
+        gboolean breed_weighted, gint tournament_size, gdouble elite_percentile, gdouble mutation_probability,
+        gint cache_bank, gint *child_slab, rng_t *rng, executor_t *executor) {
+    g_assert(experiments);
+    g_assert(child_slab);
 
-            gdouble r = (gdouble)rand() / RAND_MAX;
+    experiment_t **elite_experiments = (experiment_t **)g_new0(gpointer, nexperiments);
+    experiment_t *new_experiments = g_new0(experiment_t, nexperiments);
 
-            if(r < mutation_probability) {
-                gint idx = rand() % g_queue_get_length(download->circuits);
-                g_hash_table_insert(child->circuit_selection, download, download->circuit_list[idx]);
-            } else {
-                r = (gdouble)rand() / RAND_MAX;
-                if(r < 0.5) {
-                    g_hash_table_insert(child->circuit_selection, download, circuit1);
-                } else {
-                    g_hash_table_insert(child->circuit_selection, download, circuit2);
-                }
+    gint nelite = nexperiments * elite_percentile;
+
+    for(gint i = 0; i < nelite; i++) {
+        elite_experiments[i] = experiments[i];
+    }
+    for(gint i = nelite; i < nexperiments; i++) {
+        experiment_t *iter = experiments[i];
+        for(gint j = 0; j < nelite; j++) {
+            if(iter->score > elite_experiments[j]->score) {
+                experiment_t *t = elite_experiments[j];
+                elite_experiments[j] = iter;
+                iter = t;
             }
         }
     }
 
     for(gint i = 0; i < nexperiments; i++) {
-        g_hash_table_destroy(experiments[i]->circuit_selection);
-        experiments[i]->circuit_selection = new_experiments[i]->circuit_selection;
-        g_free(new_experiments[i]);
+        new_experiments[i].circuit_selection = child_slab + (gsize)i * network->ndownloads;
+    }
+
+    breed_data_t data;
+    data.network = network;
+    data.pool = breeding_pool_new(experiments, nexperiments, breed_percentile, breed_weighted, tournament_size);
+    data.elite_experiments = elite_experiments;
+    data.nelite = nelite;
+    data.new_experiments = new_experiments;
+    data.mutation_probability = mutation_probability;
+    data.cache_bank = cache_bank;
+    data.streams = rng_streams_new(rng, nexperiments);
+
+    /* every child draws from its own stream, so the generation does not depend on scheduling */
+    executor_parallel_for(executor, 0, nexperiments, 1, breed_worker, &data);
+
+    for(gint i = 0; i < nexperiments; i++) {
+        experiments[i]->circuit_selection = new_experiments[i].circuit_selection;
+        g_free(experiments[i]->changed_downloads);
+        experiments[i]->reference_bandwidth = new_experiments[i].reference_bandwidth;
+        experiments[i]->changed_downloads = new_experiments[i].changed_downloads;
+        experiments[i]->nchanged_downloads = new_experiments[i].nchanged_downloads;
     }
 
+    breeding_pool_free(data.pool);
+    g_free(data.streams);
+    g_free(elite_experiments);
     g_free(new_experiments);
 }
 
-void genetic_worker(experiment_t *experiment, gpointer user_data) {
+static void evaluate_experiment(experiment_t *experiment, experiment_info_t *experiment_info) {
     g_assert(experiment);
-    g_assert(user_data);
+    g_assert(experiment_info);
 
-    experiment_info_t *experiment_info = (experiment_info_t *)user_data;
     gdouble start = g_timer_elapsed(experiment_info->round_timer, NULL);
 
     /*g_usleep(G_USEC_PER_SEC);*/
 
-    experiment->score = compute_total_bandwidth(experiment_info->downloads, 
-            experiment_info->relays, experiment->circuit_selection, 
-            experiment_info->downloads_by_tick, experiment_info->ticks);
+    guint8 *dirty = NULL;
+    if(experiment->reference_bandwidth) {
+        /* mark the ticks where any download that differs from the reference is active */
+        gint *depth = g_new0(gint, experiment_info->nticks + 1);
+        for(gint i = 0; i < experiment->nchanged_downloads; i++) {
+            gint download = experiment->changed_downloads[i];
+            depth[experiment_info->download_start_ticks[download]]++;
+            depth[experiment_info->download_end_ticks[download]]--;
+        }
+
+        dirty = g_new(guint8, experiment_info->nticks);
+        gint active = 0;
+        for(gint i = 0; i < experiment_info->nticks; i++) {
+            active += depth[i];
+            dirty[i] = active > 0;
+        }
+        g_free(depth);
+    }
+
+    gint nticks_solved = 0;
+    experiment->score = compute_total_bandwidth_cached(experiment_info->network,
+            experiment->circuit_selection, experiment_info->downloads_by_tick,
+            experiment_info->ticks, experiment->tick_bandwidth[experiment_info->cache_bank],
+            experiment->reference_bandwidth, dirty, &nticks_solved, experiment_info->solve_cache,
+            experiment->cache_misses, experiment_info->executor, experiment_info->nsegments);
+    g_atomic_int_add(&experiment_info->nticks_solved, nticks_solved);
+
+    g_free(dirty);
 
     gdouble end = g_timer_elapsed(experiment_info->round_timer, NULL);
     g_message("[%f] [%f] experiment returned bandwidth of %f MB/s", end,
             end - start, experiment->score / 1024.0 / 1024.0);
 }
 
-void run_genetic_algorithm(GQueue *downloads, GHashTable *relays, gint nexperiments, 
-        gboolean initial_weighted, gdouble breed_percentile, gboolean breed_weighted, 
-        gdouble elite_percentile, gdouble mutate_probability, gint nthreads) {
+void genetic_worker(gint start, gint end, gpointer user_data) {
+    g_assert(user_data);
+
+    experiment_info_t *experiment_info = (experiment_info_t *)user_data;
+    for(gint i = start; i < end; i++) {
+        evaluate_experiment(experiment_info->experiments[i], experiment_info);
+    }
+}
+
+/* scores experiments over the given timeline from now on, downloads being
+ * its downloads by id.  With delta evaluation this also finds the tick
+ * indices each download is active between */
+static void experiment_info_set_timeline(experiment_info_t *experiment_info, GHashTable *downloads_by_tick,
+        GQueue *ticks, download_t **downloads) {
+    experiment_info->downloads_by_tick = downloads_by_tick;
+    experiment_info->ticks = ticks;
+    experiment_info->nticks = g_queue_get_length(ticks);
+
+    if(!experiment_info->delta_evaluation) {
+        return;
+    }
+
+    GHashTable *tick_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gint idx = 0;
+    for(GList *iter = g_queue_peek_head_link(ticks); iter; iter = g_list_next(iter)) {
+        g_hash_table_insert(tick_index, iter->data, GINT_TO_POINTER(idx++));
+    }
+
+    for(gint i = 0; i < experiment_info->network->ndownloads; i++) {
+        download_t *download = downloads[i];
+
+        /* dropped from a coarse timeline, so never active */
+        if(download->start_time < 0) {
+            experiment_info->download_start_ticks[i] = 0;
+            experiment_info->download_end_ticks[i] = 0;
+            continue;
+        }
+
+        experiment_info->download_start_ticks[i] = GPOINTER_TO_INT(g_hash_table_lookup(tick_index,
+                    GINT_TO_POINTER(download->start_time)));
+        experiment_info->download_end_ticks[i] = GPOINTER_TO_INT(g_hash_table_lookup(tick_index,
+                    GINT_TO_POINTER(download->end_time)));
+
+        /* a download starting and ending on the same tick is never removed */
+        if(download->start_time == download->end_time) {
+            experiment_info->download_end_ticks[i] = experiment_info->nticks;
+        }
+    }
+    g_hash_table_destroy(tick_index);
+}
+
+/* with a coarse timeline the first coarse_rounds rounds are scored on it,
+ * the best experiment of each of those rounds being scored exactly before it
+ * is saved, and every later round is scored exactly */
+void run_genetic_algorithm(GQueue *downloads, network_t *network, gint nexperiments, 
+        gboolean initial_weighted, gdouble breed_percentile, gboolean breed_weighted, gint tournament_size,
+        gdouble elite_percentile, gdouble mutate_probability, executor_t *executor, gint nsegments,
+        gboolean delta_evaluation, gint solve_cache_slots, coarse_timeline_t *coarse, gint coarse_rounds,
+        guint64 seed) {
     g_assert(downloads);
-    g_assert(relays);
+    g_assert(network);
 
     g_message("Generating initial experiment of size %d", nexperiments);
 
     experiment_info_t *experiment_info = g_new0(experiment_info_t, 1);
     experiment_info->downloads = downloads;
-    experiment_info->relays = relays;
-    experiment_info->downloads_by_tick = generate_downloads_by_tick(downloads);
-    experiment_info->ticks = g_queue_new();
+    experiment_info->network = network;
+    experiment_info->executor = executor;
+    experiment_info->nsegments = nsegments;
+    experiment_info->delta_evaluation = delta_evaluation;
+
+    GHashTable *downloads_by_tick = generate_downloads_by_tick(downloads);
+    GQueue *ticks = g_queue_new();
 
-    GList *tick_list = g_hash_table_get_keys(experiment_info->downloads_by_tick);
+    GList *tick_list = g_hash_table_get_keys(downloads_by_tick);
     tick_list = g_list_sort(tick_list, (GCompareFunc)compare_int);
     for(GList *iter = tick_list; iter; iter = g_list_next(iter)) {
-        g_queue_push_tail(experiment_info->ticks, iter->data);
+        g_queue_push_tail(ticks, iter->data);
     }
     g_list_free(tick_list);
 
-    experiment_t **experiments = generate_initial_experiments(downloads, initial_weighted, 
-            nexperiments);
+    gint nticks = g_queue_get_length(ticks);
+    if(delta_evaluation) {
+        experiment_info->download_start_ticks = g_new(gint, network->ndownloads);
+        experiment_info->download_end_ticks = g_new(gint, network->ndownloads);
+    }
+
+    if(coarse && coarse_rounds > 0) {
+        g_message("Scoring the first %d rounds over %d ms buckets, %d of %d ticks, within %f of the exact score",
+                coarse_rounds, coarse->width, g_queue_get_length(coarse->ticks), nticks,
+                coarse->error_bound / 1024.0 / 1024.0);
+        experiment_info_set_timeline(experiment_info, coarse->downloads_by_tick, coarse->ticks, coarse->downloads);
+    } else {
+        coarse = NULL;
+        experiment_info_set_timeline(experiment_info, downloads_by_tick, ticks, network->downloads);
+    }
+
+    experiment_info->selection_slab[0] = g_new(gint, (gsize)nexperiments * network->ndownloads);
+    experiment_info->selection_slab[1] = g_new(gint, (gsize)nexperiments * network->ndownloads);
+    experiment_info->selection_bank = 0;
+
+    rng_t rng;
+    rng_seed(&rng, seed);
+
+    experiment_t **experiments = generate_initial_experiments(network, downloads, initial_weighted, 
+            nexperiments, experiment_info->selection_slab[0], &rng, executor);
+    experiment_info->experiments = experiments;
+
+    if(delta_evaluation) {
+        for(gint i = 0; i < nexperiments; i++) {
+            experiments[i]->tick_bandwidth[0] = g_new0(gint, nticks);
+            experiments[i]->tick_bandwidth[1] = g_new0(gint, nticks);
+        }
+    }
+
+    if(solve_cache_slots > 0) {
+        experiment_info->solve_cache = solve_cache_new(solve_cache_slots);
+        for(gint i = 0; i < nexperiments; i++) {
+            experiments[i]->cache_misses = g_array_new(FALSE, FALSE, sizeof(solve_cache_entry_t));
+        }
+    }
 
     gint roundnum = 1;
     while(TRUE) {
         g_message("Starting round %d", roundnum);
 
-        experiment_info->round_timer = g_timer_new();
-        GThreadPool *thread_pool = g_thread_pool_new((GFunc)genetic_worker,
-            experiment_info, nthreads, TRUE, NULL);
+        if(coarse && roundnum == coarse_rounds + 1) {
+            g_message("[round %d] switching to exact scoring", roundnum);
+            experiment_info_set_timeline(experiment_info, downloads_by_tick, ticks, network->downloads);
 
-        for(gint i = 0; i < nexperiments; i++) {
-            g_thread_pool_push(thread_pool, experiments[i], NULL);
+            /* cached tick bandwidth is per coarse tick, so children are solved in full once */
+            for(gint i = 0; i < nexperiments; i++) {
+                g_free(experiments[i]->changed_downloads);
+                experiments[i]->changed_downloads = NULL;
+                experiments[i]->nchanged_downloads = 0;
+                experiments[i]->reference_bandwidth = NULL;
+            }
+            coarse = NULL;
         }
 
-        g_thread_pool_free(thread_pool, FALSE, TRUE);
+        experiment_info->round_timer = g_timer_new();
+        experiment_info->nticks_solved = 0;
+        executor_parallel_for(executor, 0, nexperiments, 1, genetic_worker, experiment_info);
         g_timer_destroy(experiment_info->round_timer);
             
+        /* ticks solved this round become visible to the next one */
+        solve_cache_t *solve_cache = experiment_info->solve_cache;
+        if(solve_cache) {
+            for(gint i = 0; i < nexperiments; i++) {
+                solve_cache_store(solve_cache, experiments[i]->cache_misses);
+            }
+        }
             
         gint max_bandwidth_idx = 0;
         gdouble total_score = 0;
@@ -1022,16 +4286,37 @@ void run_genetic_algorithm(GQueue *downloads, GHashTable *relays, gint nexperime
 
         g_message("[round %d] average total bandwidth %f", roundnum, (total_score / nexperiments) / 1024.0);
 
+        if(delta_evaluation) {
+            g_message("[round %d] delta evaluation solved %d of %d ticks", roundnum,
+                    experiment_info->nticks_solved, experiment_info->nticks * nexperiments);
+        }
+
+        if(solve_cache) {
+            g_message("[round %d] solve cache %d hits, %d misses", roundnum, solve_cache->nhits, solve_cache->nmisses);
+            solve_cache->nhits = 0;
+            solve_cache->nmisses = 0;
+        }
+
+        gdouble best_score = experiments[max_bandwidth_idx]->score;
+        if(coarse) {
+            g_message("[round %d] best coarse score %f", roundnum, best_score / 1024.0 / 1024.0);
+            best_score = compute_total_bandwidth(network, experiments[max_bandwidth_idx]->circuit_selection,
+                    downloads_by_tick, ticks, executor, nsegments);
+        }
+
         g_message("[round %d] best circuit selection at %d with bandwidth %f, saving it", roundnum, max_bandwidth_idx + 1,
-                experiments[max_bandwidth_idx]->score / 1024.0 / 1024.0);
+                best_score / 1024.0 / 1024.0);
 
 
         gchar filename[1024];
         sprintf(filename, "circuits/round%d.txt", roundnum);
-        write_circuits_to_file(downloads, experiments[max_bandwidth_idx]->circuit_selection, filename);
+        write_circuits_to_file(downloads, network, experiments[max_bandwidth_idx]->circuit_selection, filename);
     
-        breed(experiments, nexperiments, downloads, breed_percentile, breed_weighted, 
-                elite_percentile, mutate_probability);
+        experiment_info->selection_bank = 1 - experiment_info->selection_bank;
+        breed(experiments, nexperiments, network, breed_percentile, breed_weighted, tournament_size,
+                elite_percentile, mutate_probability, experiment_info->cache_bank,
+                experiment_info->selection_slab[experiment_info->selection_bank], &rng, executor);
+        experiment_info->cache_bank = 1 - experiment_info->cache_bank;
 
         roundnum++;
     }
@@ -1041,9 +4326,158 @@ void run_genetic_algorithm(GQueue *downloads, GHashTable *relays, gint nexperime
  * Greedy circuit selection algorithms
  */
 
-void greedy_circuit_selection(GQueue *downloads, GHashTable *relays) {
+/* inserts tick into the sorted tick list if it is new, the cached bandwidth at
+ * a new tick is that of the tick before it since nothing changes there yet */
+static void greedy_insert_tick(GHashTable *downloads_by_tick, GQueue *ticks, GArray *tick_bandwidth,
+        gint tick, download_t *download) {
+    GQueue *tick_downloads = g_hash_table_lookup(downloads_by_tick, GINT_TO_POINTER(tick));
+    if(!tick_downloads) {
+        tick_downloads = g_queue_new();
+        g_hash_table_insert(downloads_by_tick, GINT_TO_POINTER(tick), tick_downloads);
+
+        gint idx = 0;
+        GList *iter = g_queue_peek_head_link(ticks);
+        while(iter && GPOINTER_TO_INT(iter->data) < tick) {
+            iter = g_list_next(iter);
+            idx++;
+        }
+        g_queue_insert_before(ticks, iter, GINT_TO_POINTER(tick));
+
+        gint bandwidth = idx > 0 ? g_array_index(tick_bandwidth, gint, idx - 1) : 0;
+        g_array_insert_val(tick_bandwidth, idx, bandwidth);
+    }
+    g_queue_push_tail(tick_downloads, download);
+}
+
+/* bandwidth over ticks [start_idx, end_idx) the first of which is first_tick */
+static gdouble window_bandwidth(GList *first_tick, gint start_idx, gint end_idx, gint *tick_bandwidth) {
+    gdouble total_bandwidth = 0;
+    GList *iter = first_tick;
+    for(gint idx = start_idx; idx < end_idx; idx++, iter = g_list_next(iter)) {
+        gint tick = GPOINTER_TO_INT(iter->data);
+        gint next_tick = GPOINTER_TO_INT(g_list_next(iter)->data);
+        total_bandwidth += (gdouble)tick_bandwidth[idx] * (next_tick - tick) / 1000.0;
+    }
+    return total_bandwidth;
+}
+
+/* a worker's copy of the circuit selection, brought up to date by replaying
+ * the downloads assigned since it was last used, with the best candidate it
+ * has evaluated for the current download */
+typedef struct greedy_view_s {
+    gint *circuit_selection;
+    gint nsynced;
+    gint *candidate_bandwidth;
+    gint *best_bandwidth;
+    gint bandwidth_size;
+    gint best_circuit_idx;
+    gdouble best_circuit_bandwidth;
+} greedy_view_t;
+
+typedef struct greedy_data_s {
+    network_t *network;
+    executor_t *executor;
+    gint nsegments;
+    GHashTable *downloads_by_tick;
+    gint *circuit_selection;
+    gint *assigned_downloads;
+    gint nassigned_downloads;
+    GMutex lock;
+    GQueue *views;
+    GQueue *free_views;
+    download_t *download;
+    GList *start_link;
+    gint start_idx;
+    gint end_idx;
+    gint nticks;
+    active_set_t *active;
+    gdouble outside_bandwidth;
+} greedy_data_t;
+
+static greedy_view_t *greedy_view_acquire(greedy_data_t *data) {
+    g_mutex_lock(&data->lock);
+    greedy_view_t *view = g_queue_pop_head(data->free_views);
+    if(!view) {
+        view = g_new0(greedy_view_t, 1);
+        view->circuit_selection = circuit_selection_new(data->network);
+        view->best_circuit_idx = -1;
+        g_queue_push_tail(data->views, view);
+    }
+    g_mutex_unlock(&data->lock);
+
+    for(; view->nsynced < data->nassigned_downloads; view->nsynced++) {
+        gint download = data->assigned_downloads[view->nsynced];
+        view->circuit_selection[download] = data->circuit_selection[download];
+    }
+
+    if(view->bandwidth_size < data->nticks) {
+        view->bandwidth_size = MAX(data->nticks, 2 * view->bandwidth_size);
+        view->candidate_bandwidth = g_renew(gint, view->candidate_bandwidth, view->bandwidth_size);
+        view->best_bandwidth = g_renew(gint, view->best_bandwidth, view->bandwidth_size);
+    }
+
+    return view;
+}
+
+static void greedy_view_release(greedy_data_t *data, greedy_view_t *view) {
+    g_mutex_lock(&data->lock);
+    g_queue_push_head(data->free_views, view);
+    g_mutex_unlock(&data->lock);
+}
+
+static void greedy_view_free(greedy_view_t *view) {
+    g_free(view->circuit_selection);
+    g_free(view->candidate_bandwidth);
+    g_free(view->best_bandwidth);
+    g_free(view);
+}
+
+void greedy_worker(gint start, gint end, gpointer user_data) {
+    greedy_data_t *data = (greedy_data_t *)user_data;
+    download_t *download = data->download;
+    greedy_view_t *view = greedy_view_acquire(data);
+
+    timeline_data_t timeline;
+    timeline.network = data->network;
+    timeline.circuit_selection = view->circuit_selection;
+    timeline.downloads_by_tick = data->downloads_by_tick;
+    timeline.reference_bandwidth = NULL;
+    timeline.dirty = NULL;
+    timeline.cache = NULL;
+    timeline.cache_misses = NULL;
+
+    for(gint i = start; i < end; i++) {
+        if(!download->circuit_list && circuit_catalog_related(data->network->catalog, i)) {
+            continue;
+        }
+        view->circuit_selection[download->id] = download_circuit(download, i);
+
+        timeline.tick_bandwidth = view->candidate_bandwidth;
+        solve_timeline(&timeline, data->start_link, data->start_idx, data->end_idx, data->active,
+                data->executor, data->nsegments);
+
+        gdouble bandwidth = data->outside_bandwidth + window_bandwidth(data->start_link, data->start_idx,
+                data->end_idx, view->candidate_bandwidth);
+
+        /* earliest circuit wins ties, as if the candidates were tried in order */
+        if(view->best_circuit_idx == -1 || bandwidth > view->best_circuit_bandwidth ||
+                (bandwidth == view->best_circuit_bandwidth && i < view->best_circuit_idx)) {
+            view->best_circuit_idx = i;
+            view->best_circuit_bandwidth = bandwidth;
+
+            gint *t = view->best_bandwidth;
+            view->best_bandwidth = view->candidate_bandwidth;
+            view->candidate_bandwidth = t;
+        }
+    }
+
+    view->circuit_selection[download->id] = -1;
+    greedy_view_release(data, view);
+}
+
+void greedy_circuit_selection(GQueue *downloads, network_t *network, executor_t *executor, gint nsegments) {
     g_assert(downloads);
-    g_assert(relays);
+    g_assert(network);
 
     GTimer *timer = g_timer_new();
     gdouble last_time_elapsed = 0;
@@ -1053,55 +4487,99 @@ void greedy_circuit_selection(GQueue *downloads, GHashTable *relays) {
     }
     gint elapsed_idx = 0;
 
-    /*GHashTable *downloads_by_tick = generate_downloads_by_tick(downloads);*/
-    /*GQueue *ticks = g_list_sort(g_hash_table_get_keys(downloads_by_tick), (GCompareFunc)compare_int);*/
-
+    /* ticks of the downloads placed so far, kept sorted, with the bandwidth at
+     * each tick under the circuits chosen so far */
     GHashTable *downloads_by_tick = g_hash_table_new(g_direct_hash, g_direct_equal);
-    GHashTable *circuit_selection = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GQueue *ticks = g_queue_new();
+    GArray *cached_bandwidth = g_array_new(FALSE, FALSE, sizeof(gint));
+
+    greedy_data_t data;
+    data.network = network;
+    data.executor = executor;
+    data.nsegments = nsegments;
+    data.downloads_by_tick = downloads_by_tick;
+    data.circuit_selection = circuit_selection_new(network);
+    data.assigned_downloads = g_new(gint, network->ndownloads);
+    data.nassigned_downloads = 0;
+    g_mutex_init(&data.lock);
+    data.views = g_queue_new();
+    data.free_views = g_queue_new();
+    data.active = active_set_new(network->ndownloads);
+
+    gint *circuit_selection = data.circuit_selection;
+    active_set_t *active = data.active;
 
     gint n = 1;
     for(GList *dliter = g_queue_peek_head_link(downloads); dliter; dliter = g_list_next(dliter)) {
         download_t *download = dliter->data;
 
-        GQueue *tick_downloads;
+        greedy_insert_tick(downloads_by_tick, ticks, cached_bandwidth, download->start_time, download);
+        greedy_insert_tick(downloads_by_tick, ticks, cached_bandwidth, download->end_time, download);
 
-        tick_downloads = g_hash_table_lookup(downloads_by_tick, GINT_TO_POINTER(download->start_time));
-        if(!tick_downloads) {
-            tick_downloads = g_queue_new();
-            g_hash_table_insert(downloads_by_tick, tick_downloads, GINT_TO_POINTER(download->start_time));
-        }
-        g_queue_push_tail(tick_downloads, download);
+        gint nticks = g_queue_get_length(ticks);
 
-        tick_downloads = g_hash_table_lookup(downloads_by_tick, GINT_TO_POINTER(download->end_time));
-        if(!tick_downloads) {
-            tick_downloads = g_queue_new();
-            g_hash_table_insert(downloads_by_tick, tick_downloads, GINT_TO_POINTER(download->end_time));
+        /* the download only changes bandwidth from its start until its end, or
+         * to the end of the timeline when it starts and ends on the same tick */
+        while(active->ndownloads) {
+            active_set_remove(active, active->downloads[0]);
         }
-        g_queue_push_tail(tick_downloads, download);
-
-        GList *tick_list = g_list_sort(g_hash_table_get_keys(downloads_by_tick), (GCompareFunc)compare_int);
-        GQueue *ticks = g_queue_new();
-        for(GList *iter = tick_list; iter; iter = g_list_next(iter)) {
-            g_queue_push_tail(ticks, iter->data);
+        gint start_idx = 0;
+        GList *start_link = g_queue_peek_head_link(ticks);
+        while(GPOINTER_TO_INT(start_link->data) != download->start_time) {
+            gint tick = GPOINTER_TO_INT(start_link->data);
+            apply_tick_events(active, g_hash_table_lookup(downloads_by_tick, GINT_TO_POINTER(tick)),
+                    tick, circuit_selection);
+            start_link = g_list_next(start_link);
+            start_idx++;
+        }
+        gint end_idx = nticks - 1;
+        if(download->end_time != download->start_time) {
+            end_idx = start_idx;
+            for(GList *iter = start_link; GPOINTER_TO_INT(iter->data) != download->end_time; iter = g_list_next(iter)) {
+                end_idx++;
+            }
         }
-        g_list_free(tick_list);
-                    
 
-        circuit_t *best_circuit;
-        gdouble best_circuit_bandwidth = 0;
+        gint *tick_bandwidth = (gint *)cached_bandwidth->data;
+        data.outside_bandwidth = window_bandwidth(g_queue_peek_head_link(ticks), 0, nticks - 1, tick_bandwidth) -
+            window_bandwidth(start_link, start_idx, end_idx, tick_bandwidth);
+        data.download = download;
+        data.start_link = start_link;
+        data.start_idx = start_idx;
+        data.end_idx = end_idx;
+        data.nticks = nticks;
+
+        for(GList *iter = g_queue_peek_head_link(data.views); iter; iter = g_list_next(iter)) {
+            ((greedy_view_t *)iter->data)->best_circuit_idx = -1;
+        }
 
-        for(GList *circiter = g_queue_peek_head_link(download->circuits); circiter; circiter = g_list_next(circiter)) {
-            circuit_t *circuit = circiter->data;
-            g_hash_table_insert(circuit_selection, download, circuit);
+        executor_parallel_for(executor, 0, download->ncircuits, 1, greedy_worker, &data);
 
-            gdouble bandwidth = compute_total_bandwidth(downloads, relays, circuit_selection, downloads_by_tick, ticks);
-            if(bandwidth > best_circuit_bandwidth) {
-                best_circuit = circuit;
-                best_circuit_bandwidth = bandwidth;
+        greedy_view_t *best_view = NULL;
+        for(GList *iter = g_queue_peek_head_link(data.views); iter; iter = g_list_next(iter)) {
+            greedy_view_t *view = iter->data;
+            if(view->best_circuit_idx != -1 && (!best_view ||
+                        view->best_circuit_bandwidth > best_view->best_circuit_bandwidth ||
+                        (view->best_circuit_bandwidth == best_view->best_circuit_bandwidth &&
+                         view->best_circuit_idx < best_view->best_circuit_idx))) {
+                best_view = view;
             }
         }
 
-        g_queue_free(ticks);
+        /* every candidate is within one family, the download stays unassigned */
+        if(!best_view) {
+            n++;
+            continue;
+        }
+
+        gint best_circuit = download_circuit(download, best_view->best_circuit_idx);
+        gdouble best_circuit_bandwidth = best_view->best_circuit_bandwidth;
+        gint path[3];
+        network_circuit_path(network, best_circuit, path);
+
+        if(end_idx > start_idx) {
+            memcpy(tick_bandwidth + start_idx, best_view->best_bandwidth + start_idx, (end_idx - start_idx) * sizeof(gint));
+        }
 
         gdouble elapsed = g_timer_elapsed(timer, NULL);
         times_elapsed[elapsed_idx] = elapsed - last_time_elapsed;
@@ -1114,9 +4592,10 @@ void greedy_circuit_selection(GQueue *downloads, GHashTable *relays) {
         last_time_elapsed = elapsed;
         elapsed_idx = (elapsed_idx + 1) % 10;
 
-        g_hash_table_insert(circuit_selection, download, best_circuit);
+        circuit_selection[download->id] = best_circuit;
+        data.assigned_downloads[data.nassigned_downloads++] = download->id;
         g_message("[%f] [%d/%d] selected circuit %s %s %s with bw %f for download %f - %f (%f) on %s (estimated %f seconds left)", elapsed, n, g_queue_get_length(downloads),
-                best_circuit->guard, best_circuit->middle, best_circuit->exit, best_circuit_bandwidth, 
+                network->relay_names[path[0]], network->relay_names[path[1]], network->relay_names[path[2]], best_circuit_bandwidth, 
                 download->start_time / 1000.0, download->end_time / 1000.0, (download->end_time - download->start_time) / 1000.0,
                 download->client, time_remaining);
 
@@ -1124,13 +4603,26 @@ void greedy_circuit_selection(GQueue *downloads, GHashTable *relays) {
 
     }
 
-    g_hash_table_destroy(circuit_selection);
+    gdouble total_bandwidth = compute_total_bandwidth(network, circuit_selection, downloads_by_tick, ticks,
+            executor, nsegments);
+    g_message("Total bandwidth calculation %f", total_bandwidth / 1024.0 / 1024.0);
+
+    g_queue_free_full(data.views, (GDestroyNotify)greedy_view_free);
+    g_queue_free(data.free_views);
+    g_mutex_clear(&data.lock);
+    g_free(data.assigned_downloads);
+    active_set_free(active);
+    g_array_free(cached_bandwidth, TRUE);
+    g_queue_free(ticks);
+    g_timer_destroy(timer);
+    g_free(circuit_selection);
     g_hash_table_destroy(downloads_by_tick);
 }
 
-void run_greedy_algorithm(GQueue *downloads, GHashTable *relays, gchar *selection) {
+void run_greedy_algorithm(GQueue *downloads, network_t *network, gchar *selection, executor_t *executor,
+        gint nsegments) {
     g_assert(downloads);
-    g_assert(relays);
+    g_assert(network);
 
     if(!g_ascii_strcasecmp(selection, "inorder")) {
         g_queue_sort(downloads, (GCompareDataFunc)compare_download_by_end, NULL);
@@ -1144,92 +4636,292 @@ void run_greedy_algorithm(GQueue *downloads, GHashTable *relays, gchar *selectio
         g_queue_sort(downloads, (GCompareDataFunc)compare_download_by_end, NULL);
     }
 
-    greedy_circuit_selection(downloads, relays);
+    greedy_circuit_selection(downloads, network, executor, nsegments);
 }
 
 /*
  * Run the DWC algorithm offline, but still processing downloads in an "online" manor
  **/
 
+/* circuits scored per task, small enough that stealing evens out the tail */
+#define DWC_GRAIN 512
+
 typedef struct dwc_data_s {
-    GHashTable *relays;
-    GHashTable *active_downloads;
-    GHashTable *circuit_selection;
-    GHashTable *relay_weights;
-    GHashTable *available_bandwidth;
+    network_t *network;
+    gdouble *relay_weights;
+    gint *available_bandwidth;
     download_t *download;
-    circuit_t *best_circuit;
+    GMutex lock;
+    gint best_circuit_idx;
     gdouble best_circuit_weight;
     gint best_circuit_bandwidth;
-    gint start_idx;
-    gint end_idx;
 } dwc_data_t;
 
-void dwc_worker(dwc_data_t *dwc_data, gpointer user_data) {
-    GHashTable *circuit_selection = g_hash_table_new(g_direct_hash, g_direct_equal);
-    GHashTable *relay_weights = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
-    GHashTable *available_bandwidth = g_hash_table_new(g_str_hash, g_str_equal);
+/* lowest weight wins, then highest bandwidth, then the earliest circuit so the
+ * choice does not depend on how the range was split between threads */
+static gboolean dwc_circuit_better(gdouble weight1, gint bandwidth1, gint idx1,
+        gdouble weight2, gint bandwidth2, gint idx2) {
+    if(weight1 != weight2) {
+        return weight1 < weight2;
+    }
+    if(bandwidth1 != bandwidth2) {
+        return bandwidth1 > bandwidth2;
+    }
+    return idx1 < idx2;
+}
+
+/* weight sum and bottleneck bandwidth of circuits [start, end) of columns,
+ * written from index 0 of circuit_weight and circuit_bandwidth */
+static void dwc_score_circuits_scalar(circuit_columns_t *columns, gint start, gint end, gdouble *weights,
+        gint *bandwidths, gdouble *circuit_weight, gint *circuit_bandwidth) {
+    gint *guards = columns->relays[0];
+    gint *middles = columns->relays[1];
+    gint *exits = columns->relays[2];
+
+    for(gint i = start; i < end; i++) {
+        gint bandwidth = bandwidths[guards[i]];
+        bandwidth = MIN(bandwidth, bandwidths[middles[i]]);
+        bandwidth = MIN(bandwidth, bandwidths[exits[i]]);
+        circuit_bandwidth[i - start] = bandwidth;
+        circuit_weight[i - start] = weights[guards[i]] + weights[middles[i]] + weights[exits[i]];
+    }
+}
 
-    GHashTableIter iter;
-    gpointer key,value;
-    g_hash_table_iter_init(&iter, dwc_data->circuit_selection);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        g_hash_table_insert(circuit_selection, key, value);
+#ifdef HAVE_AVX2_KERNEL
+/* same as the scalar kernel, gathering four weights and eight bandwidths at a
+ * time, the sums are added in the same order so results are identical */
+__attribute__((target("avx2")))
+static void dwc_score_circuits_avx2(circuit_columns_t *columns, gint start, gint end, gdouble *weights,
+        gint *bandwidths, gdouble *circuit_weight, gint *circuit_bandwidth) {
+    gint *guards = columns->relays[0];
+    gint *middles = columns->relays[1];
+    gint *exits = columns->relays[2];
+
+    gint i = start;
+    for(; i + 8 <= end; i += 8) {
+        __m256i guard = _mm256_loadu_si256((__m256i *)(guards + i));
+        __m256i middle = _mm256_loadu_si256((__m256i *)(middles + i));
+        __m256i exit = _mm256_loadu_si256((__m256i *)(exits + i));
+
+        __m256i bandwidth = _mm256_i32gather_epi32(bandwidths, guard, 4);
+        bandwidth = _mm256_min_epi32(bandwidth, _mm256_i32gather_epi32(bandwidths, middle, 4));
+        bandwidth = _mm256_min_epi32(bandwidth, _mm256_i32gather_epi32(bandwidths, exit, 4));
+        _mm256_storeu_si256((__m256i *)(circuit_bandwidth + i - start), bandwidth);
+
+        for(gint half = 0; half < 2; half++) {
+            __m128i g = half ? _mm256_extracti128_si256(guard, 1) : _mm256_castsi256_si128(guard);
+            __m128i m = half ? _mm256_extracti128_si256(middle, 1) : _mm256_castsi256_si128(middle);
+            __m128i e = half ? _mm256_extracti128_si256(exit, 1) : _mm256_castsi256_si128(exit);
+
+            __m256d weight = _mm256_i32gather_pd(weights, g, 8);
+            weight = _mm256_add_pd(weight, _mm256_i32gather_pd(weights, m, 8));
+            weight = _mm256_add_pd(weight, _mm256_i32gather_pd(weights, e, 8));
+            _mm256_storeu_pd(circuit_weight + i - start + 4 * half, weight);
+        }
     }
 
-    dwc_data->best_circuit = NULL;
-    dwc_data->best_circuit_weight = G_MAXDOUBLE;
-    dwc_data->best_circuit_bandwidth = G_MININT;
+    dwc_score_circuits_scalar(columns, i, end, weights, bandwidths, circuit_weight + i - start,
+            circuit_bandwidth + i - start);
+}
+#endif
+
+static void dwc_score_circuits(circuit_columns_t *columns, gint start, gint end, gdouble *weights,
+        gint *bandwidths, gdouble *circuit_weight, gint *circuit_bandwidth) {
+#ifdef HAVE_AVX2_KERNEL
+    static gint have_avx2 = -1;
+    if(have_avx2 == -1) {
+        __builtin_cpu_init();
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if(have_avx2) {
+        dwc_score_circuits_avx2(columns, start, end, weights, bandwidths, circuit_weight, circuit_bandwidth);
+        return;
+    }
+#endif
+    dwc_score_circuits_scalar(columns, start, end, weights, bandwidths, circuit_weight, circuit_bandwidth);
+}
 
-    for(gint i = dwc_data->start_idx; i < dwc_data->end_idx; i++) {
-        circuit_t *circuit = dwc_data->download->circuit_list[i];
+void dwc_worker(gint start, gint end, gpointer user_data) {
+    dwc_data_t *dwc_data = (dwc_data_t *)user_data;
 
-        GHashTable *weights;
-        GHashTable *bandwidths;
-        if(dwc_data->relay_weights) {
-            weights = dwc_data->relay_weights;
-            bandwidths = dwc_data->available_bandwidth;
-        } else {
-            g_hash_table_insert(circuit_selection, dwc_data->download, circuit);
-            compute_download_bandwidths(dwc_data->active_downloads, dwc_data->relays, circuit_selection, relay_weights, available_bandwidth);
-            weights = relay_weights;
-            bandwidths = available_bandwidth;
-        }
+    gint best_circuit_idx = -1;
+    gdouble best_circuit_weight = G_MAXDOUBLE;
+    gint best_circuit_bandwidth = G_MININT;
 
-        gint circuit_bandwidth = GPOINTER_TO_INT(g_hash_table_lookup(bandwidths, circuit->guard));
-        circuit_bandwidth = MIN(circuit_bandwidth, GPOINTER_TO_INT(g_hash_table_lookup(bandwidths, circuit->middle)));
-        circuit_bandwidth = MIN(circuit_bandwidth, GPOINTER_TO_INT(g_hash_table_lookup(bandwidths, circuit->exit)));
+    gdouble block_weight[DWC_GRAIN];
+    gint block_bandwidth[DWC_GRAIN];
 
-        gdouble circuit_weight = 0;
-        gdouble *weight;
+    for(gint block = start; block < end; block += DWC_GRAIN) {
+        gint block_end = MIN(block + DWC_GRAIN, end);
 
-        weight = (gdouble *)g_hash_table_lookup(weights, circuit->guard);
-        if(weight) {
-            circuit_weight += *weight;
+        dwc_score_circuits(dwc_data->download->circuit_columns, block, block_end, dwc_data->relay_weights,
+                dwc_data->available_bandwidth, block_weight, block_bandwidth);
+
+        for(gint i = block; i < block_end; i++) {
+            gdouble circuit_weight = block_weight[i - block];
+            gint circuit_bandwidth = block_bandwidth[i - block];
+
+            if(circuit_weight < best_circuit_weight || (circuit_weight == best_circuit_weight && circuit_bandwidth > best_circuit_bandwidth)) {
+                best_circuit_idx = i;
+                best_circuit_weight = circuit_weight;
+                best_circuit_bandwidth = circuit_bandwidth;
+            }
         }
-        weight = (gdouble *)g_hash_table_lookup(weights, circuit->middle);
-        if(weight) {
-            circuit_weight += *weight;
+    }
+
+    g_mutex_lock(&dwc_data->lock);
+    if(best_circuit_idx != -1 && (dwc_data->best_circuit_idx == -1 ||
+                dwc_circuit_better(best_circuit_weight, best_circuit_bandwidth, best_circuit_idx,
+                    dwc_data->best_circuit_weight, dwc_data->best_circuit_bandwidth, dwc_data->best_circuit_idx))) {
+        dwc_data->best_circuit_idx = best_circuit_idx;
+        dwc_data->best_circuit_weight = best_circuit_weight;
+        dwc_data->best_circuit_bandwidth = best_circuit_bandwidth;
+    }
+    g_mutex_unlock(&dwc_data->lock);
+}
+
+/* circuit weights are summed guard, middle, exit which can round differently
+ * from a bound summed in weight order, so bounds are relaxed by this much */
+#define DWC_WEIGHT_SLACK 1e-12
+
+static gint compare_catalog_position(gconstpointer p1, gconstpointer p2, gpointer user_data) {
+    dwc_data_t *dwc_data = (dwc_data_t *)user_data;
+    circuit_catalog_t *catalog = dwc_data->network->catalog;
+    gint position1 = *(gint *)p1;
+    gint position2 = *(gint *)p2;
+    gint relay1 = catalog->relays[position1];
+    gint relay2 = catalog->relays[position2];
+
+    if(dwc_data->relay_weights[relay1] != dwc_data->relay_weights[relay2]) {
+        return dwc_data->relay_weights[relay1] < dwc_data->relay_weights[relay2] ? -1 : 1;
+    }
+    if(dwc_data->available_bandwidth[relay1] != dwc_data->available_bandwidth[relay2]) {
+        return dwc_data->available_bandwidth[relay1] > dwc_data->available_bandwidth[relay2] ? -1 : 1;
+    }
+    return position1 - position2;
+}
+
+/* exact DWC choice over the full catalog without scoring every triple.  Relays
+ * are walked lightest first, highest bandwidth first among equal weights, and
+ * a branch is cut once its lightest completion is heavier than the best circuit,
+ * or no lighter while its bottleneck is already below the best's bandwidth.
+ * Circuits that survive are scored and ranked as the scan would score them.
+ * Like the scan this leaves best_circuit_idx at -1 for an empty catalog. */
+static void dwc_search_catalog(dwc_data_t *dwc_data) {
+    circuit_catalog_t *catalog = dwc_data->network->catalog;
+    gint n = catalog->nrelays;
+
+    gint *order = g_new(gint, n);
+    for(gint p = 0; p < n; p++) {
+        order[p] = p;
+    }
+    g_qsort_with_data(order, n, sizeof(gint), compare_catalog_position, dwc_data);
+
+    gdouble *weight = g_new(gdouble, n);
+    gint *bandwidth = g_new(gint, n);
+    gboolean *is_exit = g_new(gboolean, n);
+    gint *group_end = g_new(gint, n);
+    gint *next_exit = g_new(gint, n + 1);
+
+    for(gint p = 0; p < n; p++) {
+        gint relay = catalog->relays[order[p]];
+        weight[p] = dwc_data->relay_weights[relay];
+        bandwidth[p] = dwc_data->available_bandwidth[relay];
+        is_exit[p] = (catalog->relay_flags[order[p]] & RELAY_FLAG_EXIT) != 0;
+    }
+
+    /* group_end skips the rest of a run of equal weights, whose bandwidth only drops */
+    next_exit[n] = n;
+    for(gint p = n - 1; p >= 0; p--) {
+        group_end[p] = (p + 1 < n && weight[p + 1] == weight[p]) ? group_end[p + 1] : p + 1;
+        next_exit[p] = is_exit[p] ? p : next_exit[p + 1];
+    }
+
+    gint best_circuit_idx = -1;
+    gdouble best_circuit_weight = G_MAXDOUBLE;
+    gint best_circuit_bandwidth = G_MININT;
+
+    for(gint a = 0; a < n - 2; a++) {
+        gdouble bound = (weight[a] + weight[a + 1] + weight[a + 2]) * (1 - DWC_WEIGHT_SLACK);
+        if(bound > best_circuit_weight) {
+            break;
         }
-        weight = (gdouble *)g_hash_table_lookup(weights, circuit->exit);
-        if(weight) {
-            circuit_weight += *weight;
+        if(bound >= best_circuit_weight && bandwidth[a] < best_circuit_bandwidth) {
+            a = group_end[a] - 1;
+            continue;
         }
 
-        if(circuit_weight < dwc_data->best_circuit_weight || (circuit_weight == dwc_data->best_circuit_weight && circuit_bandwidth > dwc_data->best_circuit_bandwidth)) {
-            dwc_data->best_circuit = circuit;
-            dwc_data->best_circuit_weight = circuit_weight;
-            dwc_data->best_circuit_bandwidth = circuit_bandwidth;
+        for(gint b = a + 1; b < n - 1; b++) {
+            bound = (weight[a] + weight[b] + weight[b + 1]) * (1 - DWC_WEIGHT_SLACK);
+            if(bound > best_circuit_weight) {
+                break;
+            }
+            gint pair_bandwidth = MIN(bandwidth[a], bandwidth[b]);
+            if(bound >= best_circuit_weight && pair_bandwidth < best_circuit_bandwidth) {
+                if(bandwidth[a] < best_circuit_bandwidth) {
+                    break;
+                }
+                b = group_end[b] - 1;
+                continue;
+            }
+
+            /* two relays that are not exits need an exit to make a circuit */
+            gboolean need_exit = !is_exit[a] && !is_exit[b];
+            for(gint c = need_exit ? next_exit[b + 1] : b + 1; c < n; c = need_exit ? next_exit[c + 1] : c + 1) {
+                bound = (weight[a] + weight[b] + weight[c]) * (1 - DWC_WEIGHT_SLACK);
+                if(bound > best_circuit_weight) {
+                    break;
+                }
+                gint circuit_bandwidth = MIN(pair_bandwidth, bandwidth[c]);
+                if(bound >= best_circuit_weight && circuit_bandwidth < best_circuit_bandwidth) {
+                    if(pair_bandwidth < best_circuit_bandwidth) {
+                        break;
+                    }
+                    c = group_end[c] - 1;
+                    continue;
+                }
+
+                gint position[3] = {order[a], order[b], order[c]};
+                gint i = MIN(position[0], MIN(position[1], position[2]));
+                gint k = MAX(position[0], MAX(position[1], position[2]));
+                gint j = position[0] + position[1] + position[2] - i - k;
+                if(catalog_related(catalog, i, j, k)) {
+                    continue;
+                }
+
+                gint path[3];
+                gint circuit_idx = circuit_catalog_lookup(catalog, i, j, k, path);
+                if(circuit_idx == -1) {
+                    continue;
+                }
+                gdouble circuit_weight = dwc_data->relay_weights[path[0]] + dwc_data->relay_weights[path[1]] +
+                    dwc_data->relay_weights[path[2]];
+
+                if(dwc_circuit_better(circuit_weight, circuit_bandwidth, circuit_idx,
+                            best_circuit_weight, best_circuit_bandwidth, best_circuit_idx)) {
+                    best_circuit_idx = circuit_idx;
+                    best_circuit_weight = circuit_weight;
+                    best_circuit_bandwidth = circuit_bandwidth;
+                }
+            }
         }
     }
 
-    g_hash_table_destroy(relay_weights);
-    g_hash_table_destroy(circuit_selection);
+    dwc_data->best_circuit_idx = best_circuit_idx;
+    dwc_data->best_circuit_weight = best_circuit_weight;
+    dwc_data->best_circuit_bandwidth = best_circuit_bandwidth;
+
+    g_free(order);
+    g_free(weight);
+    g_free(bandwidth);
+    g_free(is_exit);
+    g_free(group_end);
+    g_free(next_exit);
 }
 
-GHashTable* run_dwc_algorithm(GQueue *downloads, GHashTable *relays, gint nthreads) {
+gint *run_dwc_algorithm(GQueue *downloads, network_t *network, executor_t *executor, gint nsegments) {
     g_assert(downloads);
-    g_assert(relays);
+    g_assert(network);
 
     GHashTable *downloads_by_tick = generate_downloads_by_tick(downloads);
     GQueue *ticks = g_queue_new();
@@ -1241,17 +4933,16 @@ GHashTable* run_dwc_algorithm(GQueue *downloads, GHashTable *relays, gint nthrea
     }
     g_list_free(tick_list);
 
-    GHashTable *active_downloads = g_hash_table_new(g_direct_hash, g_direct_equal);
-    GHashTable *circuit_selection = g_hash_table_new(g_direct_hash, g_direct_equal);
+    active_set_t *active_downloads = active_set_new(network->ndownloads);
+    gint *circuit_selection = circuit_selection_new(network);
+    gdouble *relay_weights = g_new0(gdouble, network->nrelays);
+    gint *available_bandwidth = g_new0(gint, network->nrelays);
 
-    dwc_data_t **dwc_data = (dwc_data_t **)g_new0(gpointer, nthreads);
-
-    for(gint i = 0; i < nthreads; i++) {
-        dwc_data[i] = g_new0(dwc_data_t, 1);
-        dwc_data[i]->relays = relays;
-        dwc_data[i]->active_downloads = active_downloads;
-        dwc_data[i]->circuit_selection = circuit_selection;
-    }
+    dwc_data_t dwc_data;
+    dwc_data.network = network;
+    dwc_data.relay_weights = relay_weights;
+    dwc_data.available_bandwidth = available_bandwidth;
+    g_mutex_init(&dwc_data.lock);
 
     gint n = 0;
     gint ndownloads = g_queue_get_length(downloads);
@@ -1267,7 +4958,7 @@ GHashTable* run_dwc_algorithm(GQueue *downloads, GHashTable *relays, gint nthrea
             download_t *download = diter->data;
 
             if(download->end_time == tick) {
-                g_hash_table_remove(active_downloads, download);
+                active_set_remove(active_downloads, download->id);
             }
         }
 
@@ -1278,54 +4969,34 @@ GHashTable* run_dwc_algorithm(GQueue *downloads, GHashTable *relays, gint nthrea
             /*compute_download_bandwidths(active_downloads, relays, circuit_selection, relay_weights, available_bandwidth);*/
 
             if(download->start_time == tick) {
-                circuit_t *best_circuit = NULL;
-                gdouble best_circuit_weight = G_MAXDOUBLE;
-                gint best_circuit_bandwidth = G_MININT;
-
-                GHashTable *relay_weights = NULL;
-                GHashTable *available_bandwidth = NULL;
-
-                /*g_hash_table_insert(active_downloads, download, GINT_TO_POINTER(TRUE));*/
-
-                relay_weights = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
-                available_bandwidth = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
-                compute_download_bandwidths(active_downloads, relays, circuit_selection, relay_weights, available_bandwidth);
-
-                gint interval = g_queue_get_length(download->circuits) / nthreads;
-                for(gint i = 0; i < nthreads; i++) {
-                    dwc_data[i]->relay_weights = relay_weights;
-                    dwc_data[i]->available_bandwidth = available_bandwidth;
-                    dwc_data[i]->download = download;
-                    dwc_data[i]->best_circuit = NULL;
-                    dwc_data[i]->best_circuit_weight = G_MAXDOUBLE;
-                    dwc_data[i]->best_circuit_bandwidth = G_MININT;
-                    dwc_data[i]->start_idx = i * interval;
-                    dwc_data[i]->end_idx = (i+1) * interval;
-                }
-                dwc_data[nthreads - 1]->end_idx = g_queue_get_length(download->circuits);
+                compute_download_bandwidths(network, active_downloads, circuit_selection, relay_weights, available_bandwidth);
+
+                dwc_data.download = download;
+                dwc_data.best_circuit_idx = -1;
+                dwc_data.best_circuit_weight = G_MAXDOUBLE;
+                dwc_data.best_circuit_bandwidth = G_MININT;
 
-                GThreadPool *thread_pool = g_thread_pool_new((GFunc)dwc_worker, NULL, nthreads, TRUE, NULL);
-                for(gint i = 0; i < nthreads; i++) {
-                    g_thread_pool_push(thread_pool, dwc_data[i], NULL);
+                if(!download->circuit_list) {
+                    dwc_search_catalog(&dwc_data);
+                } else {
+                    executor_parallel_for(executor, 0, download->ncircuits, DWC_GRAIN, dwc_worker, &dwc_data);
                 }
-                g_thread_pool_free(thread_pool, FALSE, TRUE);
-
-                for(gint i = 0; i < nthreads; i++) {
-                    /*g_message("[thread-%d] best weight %f", i+1, dwc_data[i]->best_circuit_weight);*/
-                    if(best_circuit_weight > dwc_data[i]->best_circuit_weight || (best_circuit_weight == dwc_data[i]->best_circuit_weight && best_circuit_bandwidth < dwc_data[i]->best_circuit_bandwidth)) {
-                        best_circuit = dwc_data[i]->best_circuit;
-                        best_circuit_weight = dwc_data[i]->best_circuit_weight;
-                        best_circuit_bandwidth = dwc_data[i]->best_circuit_bandwidth;
-                    }
+
+                /* no circuit to choose from, the download stays unassigned */
+                if(dwc_data.best_circuit_idx == -1) {
+                    continue;
                 }
 
-                g_hash_table_destroy(relay_weights);
-                g_hash_table_destroy(available_bandwidth);
+                gint best_circuit = download_circuit(download, dwc_data.best_circuit_idx);
+                gdouble best_circuit_weight = dwc_data.best_circuit_weight;
+                gint best_circuit_bandwidth = dwc_data.best_circuit_bandwidth;
+                gint path[3];
+                network_circuit_path(network, best_circuit, path);
 
-                g_hash_table_insert(active_downloads, download, GINT_TO_POINTER(TRUE));
-                g_hash_table_insert(circuit_selection, download, best_circuit);
+                active_set_add(active_downloads, download->id);
+                circuit_selection[download->id] = best_circuit;
 
-                gint total_bandwidth = compute_download_bandwidths(active_downloads, relays, circuit_selection, NULL, NULL);
+                gint total_bandwidth = compute_download_bandwidths(network, active_downloads, circuit_selection, NULL, NULL);
 
                 n++;
 
@@ -1335,17 +5006,23 @@ GHashTable* run_dwc_algorithm(GQueue *downloads, GHashTable *relays, gint nthrea
 
                 g_message("[%f] [%f MB/s] [%d/%d] [%s] download %f-%f assigned circuit %s,%s,%s (weight %f bw %d) (%d active) (time left %f)", elapsed, total_bandwidth / 1024.0, n, ndownloads,
                         download->client, download->start_time / 1000.0, download->end_time / 1000.0,
-                        best_circuit->guard, best_circuit->middle, best_circuit->exit, best_circuit_weight, best_circuit_bandwidth, g_hash_table_size(active_downloads), time_left);
+                        network->relay_names[path[0]], network->relay_names[path[1]], network->relay_names[path[2]],
+                        best_circuit_weight, best_circuit_bandwidth, active_downloads->ndownloads, time_left);
             }
         }
 
     }
 
-    gdouble total_bandwidth = compute_total_bandwidth(downloads, relays, circuit_selection, downloads_by_tick, ticks);
+    gdouble total_bandwidth = compute_total_bandwidth(network, circuit_selection, downloads_by_tick, ticks,
+            executor, nsegments);
     g_message("Total bandwidth calculation %f", total_bandwidth / 1024.0 / 1024.0);
 
     g_hash_table_destroy(downloads_by_tick);
     g_queue_free(ticks);
+    active_set_free(active_downloads);
+    g_mutex_clear(&dwc_data.lock);
+    g_free(relay_weights);
+    g_free(available_bandwidth);
 
     return circuit_selection;
 }
@@ -1353,23 +5030,22 @@ GHashTable* run_dwc_algorithm(GQueue *downloads, GHashTable *relays, gint nthrea
 /*
  * Estimate maximum bandwidth of Tor network
  **/
-void estimate_max_bandwidth(GQueue *circuits, GHashTable *relays) {
-    g_assert(circuits);
-    g_assert(relays);
-
-    GHashTable *circuit_selection = g_hash_table_new(g_direct_hash, g_direct_equal);
-    GHashTable *downloads = g_hash_table_new_full(g_direct_hash, g_direct_equal, g_free, NULL);
-    for(GList *iter = g_queue_peek_head_link(circuits); iter; iter = g_list_next(iter)) {
-        circuit_t *circuit = iter->data;
-        download_t *download = g_new0(download_t, 1);
-        download->start_time = 0;
-        download->end_time = 100;
-        g_hash_table_insert(downloads, download, GINT_TO_POINTER(TRUE));
-        g_hash_table_insert(circuit_selection, download, circuit);
+void estimate_max_bandwidth(network_t *network) {
+    g_assert(network);
+
+    /* one download per circuit, download i uses circuit i */
+    gint *circuit_selection = g_new(gint, network->ncircuits);
+    active_set_t *downloads = active_set_new(network->ncircuits);
+    for(gint i = 0; i < network->ncircuits; i++) {
+        circuit_selection[i] = i;
+        active_set_add(downloads, i);
     }
 
-    gdouble bandwidth = compute_download_bandwidths(downloads, relays, circuit_selection, NULL, NULL);
+    gdouble bandwidth = compute_download_bandwidths(network, downloads, circuit_selection, NULL, NULL);
     g_message("maximum bandwidth is %f", bandwidth);
+
+    active_set_free(downloads);
+    g_free(circuit_selection);
 }
 
 
@@ -1381,13 +5057,18 @@ int main(int argc, char **argv) {
     GError *error = NULL;
     GOptionContext *context = NULL;
 
-    context = g_option_context_new("<downloads.txt> <relays.txt> <genetic|greedy|maxbw|dwc>");
+    context = g_option_context_new("<downloads.txt> <relays.txt> <genetic|greedy|maxbw|dwc> | --scenario=FILE <mode>");
     g_option_context_set_summary(context, "Tor circuit selection simulator");
 
     gboolean pruned_circuits = FALSE;
+    gchar *prune_strategy = NULL;
+    gint prune_count = 0;
     gchar *circuits_filename = NULL;
+    gchar *compile_filename = NULL;
+    gchar *scenario_filename = NULL;
     gchar *output_directory = NULL;
     gchar *log_level = NULL;
+    gint nsegments = 1;
 
     GOptionGroup *mainGroup = g_option_group_new("main", "Main Options", "Primary simulator options", NULL, NULL);
     const GOptionEntry mainEntries[] =  
@@ -1396,10 +5077,20 @@ int main(int argc, char **argv) {
             "List of circuits to consider.  If none provided full circuit list is generated and used.", "FILENAME"},
         { "pruned", 'p', 0, G_OPTION_ARG_NONE, &pruned_circuits,
             "Use pruned set of circuits instead of all possible combinations", NULL},
+        { "prune", 0, 0, G_OPTION_ARG_STRING, &prune_strategy,
+            "How the pruned set is built ('greedy', 'top-k', 'sampled'), implies --pruned ['greedy']", "STRATEGY"},
+        { "prune-count", 0, 0, G_OPTION_ARG_INT, &prune_count,
+            "Circuits kept per relay with top-k [3], or circuits drawn with sampled, seeded by --seed [10000]", "N"},
         { "output", 'o', 0, G_OPTION_ARG_STRING, &output_directory, 
             "Output where any circuits generated will be saved [circuits]", "DIRECTORY"},
         { "log", 'l', 0, G_OPTION_ARG_STRING, &log_level, 
             "Log level to print out messages ('debug', 'info', 'message', 'warning', 'error') ['message']", "LOGLEVEL"},
+        { "segments", 0, 0, G_OPTION_ARG_INT, &nsegments,
+            "Split the timeline into N segments solved in parallel when computing total bandwidth [1]", "N"},
+        { "compile", 0, 0, G_OPTION_ARG_FILENAME, &compile_filename,
+            "Write the downloads, relays and circuits built from the inputs to FILENAME as a compiled scenario and exit", "FILENAME"},
+        { "scenario", 0, 0, G_OPTION_ARG_FILENAME, &scenario_filename,
+            "Load a compiled scenario instead of input files, the only argument then being the mode", "FILENAME"},
         { NULL }
     };
     g_option_group_add_entries(mainGroup, mainEntries);
@@ -1409,9 +5100,15 @@ int main(int argc, char **argv) {
     gboolean initial_unweighted = FALSE;
     gdouble breed_percentile = 0.2;
     gboolean breed_unweighted = FALSE;
+    gint tournament_size = 0;
     gdouble elite_percentile = 0.1;
     gdouble mutate_probability = 0.01;
     gint nthreads = 4;
+    gboolean delta_evaluation = FALSE;
+    gint solve_cache_slots = 1 << 20;
+    gint coarse_width = 0;
+    gint coarse_rounds = 10;
+    gint64 seed = 1;
 
     GOptionGroup *geneticGroup = g_option_group_new("genetic", "Genetic Algorithm Options", "Genetic algorithm parameters", NULL, NULL);
     const GOptionEntry geneticEntries[] =  
@@ -1424,12 +5121,24 @@ int main(int argc, char **argv) {
             "Top percent of population to draw from when breeding [0.2]", "f"},
         { "breed-unweighted", 0, 0, G_OPTION_ARG_NONE, &breed_unweighted,
             "Breed parents selected uniformly at random instead of weighted by their bandwidth", NULL},
+        { "tournament", 0, 0, G_OPTION_ARG_INT, &tournament_size,
+            "Select each parent as the best of N experiments drawn from the whole population [0, disabled]", "N"},
         { "elite-percentile", 'b', 0, G_OPTION_ARG_DOUBLE, &elite_percentile, 
             "Top percent of parents to keep in new population [0.1]", "f"},
         { "mutate", 'm', 0, G_OPTION_ARG_DOUBLE, &mutate_probability, 
             "Probability of mutating any single download [0.01]", "f"},
         { "threads", 't', 0, G_OPTION_ARG_INT, &nthreads, 
-            "Number of threads to use for calculating population bandwidth [4]", "N"},
+            "Number of threads used to evaluate experiments, greedy candidates and DWC circuits [4]", "N"},
+        { "delta", 0, 0, G_OPTION_ARG_NONE, &delta_evaluation,
+            "Cache per tick bandwidth and only re-solve the ticks where a child differs from its closest parent", NULL},
+        { "solve-cache", 0, 0, G_OPTION_ARG_INT, &solve_cache_slots,
+            "Slots of the cache of tick bandwidths shared by all experiments, filled after each round so hits only come from earlier rounds, 0 to disable [1048576]", "N"},
+        { "coarse", 0, 0, G_OPTION_ARG_INT, &coarse_width,
+            "Score the early rounds with start and end times moved to multiples of MS milliseconds [0, disabled]", "MS"},
+        { "coarse-rounds", 0, 0, G_OPTION_ARG_INT, &coarse_rounds,
+            "Rounds scored coarsely before switching to exact scoring [10]", "N"},
+        { "seed", 0, 0, G_OPTION_ARG_INT64, &seed,
+            "Seed for the random number generator, runs with the same seed are identical [1]", "N"},
         { NULL }
     };
     g_option_group_add_entries(geneticGroup, geneticEntries);
@@ -1440,7 +5149,7 @@ int main(int argc, char **argv) {
     GOptionGroup *greedyGroup = g_option_group_new("greedy", "Greedy Algorithm Options", "Greedy algorithm parameters", NULL, NULL);
     const GOptionEntry greedyEntries[] =  
     {
-        { "selection", 's', 0, G_OPTION_ARG_STRING, &population_size, "Selection stategy used during greedy algorithm ('inorder', 'longest', 'shortest') ['inorder']", "SELECTION"},
+        { "selection", 0, 0, G_OPTION_ARG_STRING, &greedy_selection, "Selection stategy used during greedy algorithm ('inorder', 'longest', 'shortest') ['inorder']", "SELECTION"},
         { NULL }
     };
     g_option_group_add_entries(greedyGroup, greedyEntries);
@@ -1455,7 +5164,7 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    if(argc < 3) {
+    if(argc < (scenario_filename ? 2 : compile_filename ? 3 : 4)) {
         g_printerr("** Please provide the required parameters **\n");
         gchar *helpString = g_option_context_get_help(context, TRUE, NULL);
         g_printerr("%s", helpString);
@@ -1463,6 +5172,8 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    gchar *mode = argv[scenario_filename ? 1 : 3];
+
     /* set defaults */
     if(!output_directory) {
         output_directory = g_strdup("circuits");
@@ -1473,6 +5184,14 @@ int main(int argc, char **argv) {
     if(!greedy_selection) {
         greedy_selection = g_strdup("inorder");
     }
+    if(prune_strategy) {
+        pruned_circuits = TRUE;
+    } else {
+        prune_strategy = g_strdup("greedy");
+    }
+    if(prune_count <= 0) {
+        prune_count = !g_ascii_strcasecmp(prune_strategy, "sampled") ? 10000 : 3;
+    }
 
     if(!g_ascii_strcasecmp(log_level, "debug")) {
         min_log_level = G_LOG_LEVEL_DEBUG;
@@ -1488,53 +5207,99 @@ int main(int argc, char **argv) {
 
     g_log_set_handler(NULL, G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL | G_LOG_FLAG_RECURSION, log_handler_cb, NULL);
 
-    g_message("Reading list of downloads");
-    GHashTable *client_downloads = read_downloads(argv[1]);
-    if(!client_downloads) {
-        g_error("could not read in download list");
-        return -1;
-    }
-    GQueue *downloads = get_all_downloads(client_downloads);
-
-    g_message("Reading list of relays");
-    GHashTable *relays = read_relays(argv[2]);
-    if(!relays) {
-        g_error("could not read in relay list");
-        return -1;
-    }
+    executor_t *executor = executor_new(nthreads);
 
+    GQueue *downloads = NULL;
     GQueue *circuits = NULL;
-    circuit_t **circuit_list = NULL;
-    circuit_t **weighted_circuit_list;
-    gint total_circuit_bandwidth;
-
-    if(circuits_filename) {
-        g_message("Reading list of circuits");
-        circuits = read_circuits(circuits_filename, client_downloads);
-    } else if(pruned_circuits) {
-        g_message("Building set of pruned circuits");
-        circuits = build_pruned_circuits(relays);
+    circuit_t **circuit_spans = NULL;
+    GHashTable *relays = NULL;
+    GHashTable *relay_flags = NULL;
+    network_t *network = NULL;
+    scenario_t *scenario = NULL;
+    input_data_t input = {{NULL, NULL, circuits_filename}, {NULL, NULL, NULL}};
+
+    if(scenario_filename) {
+        g_message("Loading compiled scenario %s", scenario_filename);
+        scenario = scenario_load(scenario_filename);
+        if(!scenario) {
+            g_error("could not load compiled scenario");
+            return -1;
+        }
+        downloads = scenario->downloads;
+        network = scenario->network;
     } else {
-        g_message("Building list of all potential circuits");
-        circuits = build_all_circuits(relays);
-    }
-    generate_circuit_lists(circuits, &circuit_list, &weighted_circuit_list,
-            &total_circuit_bandwidth);
+        g_message(circuits_filename ? "Reading lists of downloads, relays and circuits" :
+                "Reading lists of downloads and relays");
+        input.filenames[0] = argv[1];
+        input.filenames[1] = argv[2];
+        for(gint i = 0; i < 3; i++) {
+            input.names[i] = g_string_chunk_new(4096);
+        }
+        input.relay_flags = g_hash_table_new(g_str_hash, g_str_equal);
+        executor_parallel_for(executor, 0, circuits_filename ? 3 : 2, 1, read_input_worker, &input);
 
-    /* go through the downloads, any one that has no circuits assigned use global list */
-    for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
-        download_t *download = iter->data;
-        if(!download->circuits) {
-            download->circuits = circuits;
-            download->circuit_list = circuit_list;
-            download->weighted_circuit_list = weighted_circuit_list;
-            download->total_circuit_bandwidth = total_circuit_bandwidth;
+        GHashTable *client_downloads = input.client_downloads;
+        if(!client_downloads) {
+            g_error("could not read in download list");
+            return -1;
+        }
+        downloads = get_all_downloads(client_downloads);
+
+        relay_flags = input.relay_flags;
+        relays = input.relays;
+        if(!relays) {
+            g_error("could not read in relay list");
+            return -1;
+        }
+
+        circuit_catalog_t *catalog = NULL;
+        circuit_t **circuit_list = NULL;
+        circuit_sampler_t *circuit_sampler = NULL;
+
+        if(circuits_filename) {
+            circuits = input.circuits;
+            drop_related_circuits(circuits, relay_flags);
+            circuit_spans = assign_circuits(circuits, client_downloads);
+        } else if(pruned_circuits) {
+            g_message("Building set of pruned circuits with the %s strategy", prune_strategy);
+            circuits = build_pruned_circuits(relays, relay_flags, prune_strategy, prune_count, seed);
         } else {
-            generate_circuit_lists(download->circuits, &download->circuit_list, 
-                    &download->weighted_circuit_list, &download->total_circuit_bandwidth);
+            g_message("Building catalog of all potential circuits");
+            catalog = circuit_catalog_new(relays, relay_flags);
+        }
+
+        if(catalog) {
+            circuit_sampler = g_new0(circuit_sampler_t, 1);
+            circuit_sampler->ncircuits = catalog->ncircuits;
+            circuit_sampler->catalog = catalog;
+        } else {
+            generate_circuit_lists(circuits, &circuit_list, &circuit_sampler);
+        }
+
+        /* go through the downloads, any one that has no circuits assigned use global list */
+        gint nglobal = circuits ? g_queue_get_length(circuits) : 0;
+        for(GList *iter = g_queue_peek_head_link(downloads); iter; iter = g_list_next(iter)) {
+            download_t *download = iter->data;
+            if(!download->circuit_list) {
+                download->ncircuits = nglobal;
+                download->circuit_list = circuit_list;
+                download->circuit_sampler = circuit_sampler;
+            } else {
+                download->circuit_sampler = circuit_sampler_new(download->circuit_list, download->ncircuits);
+            }
         }
-    }
 
+        network = network_new(relays, circuits, catalog, downloads);
+
+        if(compile_filename) {
+            g_message("Writing compiled scenario to %s", compile_filename);
+            if(!scenario_write(compile_filename, network, relay_flags)) {
+                g_error("could not write compiled scenario");
+                return -1;
+            }
+            return 0;
+        }
+    }
 
     /* create the output directory */
     if(!g_file_test(output_directory, (G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))) {
@@ -1545,26 +5310,28 @@ int main(int argc, char **argv) {
     }
 
     gint ndownloads = g_queue_get_length(downloads);
-    gint nrelays = g_hash_table_size(relays);
-    gint ncircuits = g_queue_get_length(circuits);
+    gint nrelays = network->nrelays;
+    gint ncircuits = network->ncircuits;
 
     g_message("There are %d downloads, %d relays, and %d circuits", ndownloads, nrelays, ncircuits);
 
-    g_message("Running simulator in '%s' mode", argv[3]);
-
-    GHashTable *circuit_selection = NULL;
-
-    if(!g_ascii_strcasecmp(argv[3], "genetic")) {
-        run_genetic_algorithm(downloads, relays, population_size, !initial_unweighted,
-                breed_percentile, !breed_unweighted, elite_percentile, mutate_probability, nthreads);
-    } else if(!g_ascii_strcasecmp(argv[3], "greedy")) {
-        run_greedy_algorithm(downloads, relays, greedy_selection);
-    } else if(!g_ascii_strcasecmp(argv[3], "maxbw")) {
-        estimate_max_bandwidth(circuits, relays);
-    } else if(!g_ascii_strcasecmp(argv[3], "dwc")) {
-        circuit_selection = run_dwc_algorithm(downloads, relays, nthreads);
+    g_message("Running simulator in '%s' mode", mode);
+
+    gint *circuit_selection = NULL;
+
+    if(!g_ascii_strcasecmp(mode, "genetic")) {
+        coarse_timeline_t *coarse = coarse_width > 0 ? coarse_timeline_new(network, coarse_width) : NULL;
+        run_genetic_algorithm(downloads, network, population_size, !initial_unweighted,
+                breed_percentile, !breed_unweighted, tournament_size, elite_percentile, mutate_probability,
+                executor, nsegments, delta_evaluation, solve_cache_slots, coarse, coarse_rounds, seed);
+    } else if(!g_ascii_strcasecmp(mode, "greedy")) {
+        run_greedy_algorithm(downloads, network, greedy_selection, executor, nsegments);
+    } else if(!g_ascii_strcasecmp(mode, "maxbw")) {
+        estimate_max_bandwidth(network);
+    } else if(!g_ascii_strcasecmp(mode, "dwc")) {
+        circuit_selection = run_dwc_algorithm(downloads, network, executor, nsegments);
     } else {
-        g_error("Did not recognize mode '%s'", argv[3]);
+        g_error("Did not recognize mode '%s'", mode);
     }
 
     if(circuit_selection) {
@@ -1586,12 +5353,14 @@ int main(int argc, char **argv) {
             GString *buffer = g_string_new("");
             for(GList *iter = download_list; iter; iter = g_list_next(iter)) {
                 download_t *download = iter->data;
-                circuit_t *circuit = g_hash_table_lookup(circuit_selection, download);
-                if(!circuit) {
+                gint circuit_id = circuit_selection[download->id];
+                if(circuit_id == -1) {
                     g_warning("no circuit selected for download %s at time %f", client, download->start_time / 1000.0);
                 } else {
+                    gint path[3];
+                    network_circuit_path(network, circuit_id, path);
                     g_string_append_printf(buffer, "%f %s,%s,%s\n", download->start_time / 1000.0,
-                            circuit->guard, circuit->middle, circuit->exit);
+                            network->relay_names[path[0]], network->relay_names[path[1]], network->relay_names[path[2]]);
                 }
             }
 
@@ -1606,16 +5375,30 @@ int main(int argc, char **argv) {
         }
 
         g_hash_table_destroy(downloads_by_client);
-        g_hash_table_destroy(circuit_selection);
+        g_free(circuit_selection);
     }
 
+    executor_free(executor);
     g_free(output_directory);
     g_free(log_level);
     g_free(greedy_selection);
+    g_free(prune_strategy);
 
-    g_queue_free_full(downloads, (GDestroyNotify)free_download);
-    g_queue_free_full(circuits, g_free);
-    g_hash_table_destroy(relays);
+    if(scenario) {
+        scenario_free(scenario);
+    } else {
+        network_free(network);
+        g_queue_free_full(downloads, (GDestroyNotify)free_download);
+        if(circuits) {
+            g_queue_free_full(circuits, g_free);
+        }
+        g_free(circuit_spans);
+        g_hash_table_destroy(relay_flags);
+        g_hash_table_destroy(relays);
+        for(gint i = 0; i < 3; i++) {
+            g_string_chunk_free(input.names[i]);
+        }
+    }
 
     return 0;
 }